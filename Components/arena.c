@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2006-2015 Michael Roitzsch <mroi@os.inf.tu-dresden.de>
+ * economic rights: Technische Universitaet Dresden (Germany)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#pragma clang diagnostic ignored "-Wpadded"
+
+/* allocations are carved from blocks of this size, larger ones get a block of their own */
+#define ARENA_BLOCK_SIZE (1 << 16)
+/* alignment of all allocations, enough for any scalar and SIMD type */
+#define ARENA_ALIGN 16
+
+typedef struct arena_block_s arena_block_t;
+
+struct arena_block_s {
+	arena_block_t *next;
+	size_t size, used;
+	/* the block's memory follows the header, which is padded to the alignment */
+	uint8_t *data;
+};
+
+struct arena_s {
+	/* the blocks in allocation order, blocks after current are unused */
+	arena_block_t *first, *current;
+	unsigned reference_count;
+};
+
+static inline size_t align(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static arena_block_t *block_alloc(size_t size)
+{
+	const size_t header = align(sizeof(arena_block_t));
+	arena_block_t *block;
+	void *memory;
+	
+	if (posix_memalign(&memory, ARENA_ALIGN, header + size) != 0) {
+		fprintf(stderr, "could not allocate %zu bytes of arena storage\n", size);
+		abort();
+	}
+	block = memory;
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	block->data = (uint8_t *)memory + header;
+	return block;
+}
+
+
+arena_t *arena_alloc(void)
+{
+	arena_t *arena = malloc(sizeof(arena_t));
+	if (!arena) return NULL;
+	
+	arena->first = arena->current = block_alloc(ARENA_BLOCK_SIZE);
+	arena->reference_count = 1;
+	return arena;
+}
+
+void *arena_push(arena_t *arena, size_t size)
+{
+	arena_block_t *block = arena->current;
+	void *memory;
+	
+	size = align(size);
+	while (block->used + size > block->size) {
+		/* continue with the next block kept from before a reset or add a new one */
+		if (!block->next)
+			block->next = block_alloc(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+		block = arena->current = block->next;
+		block->used = 0;
+	}
+	memory = block->data + block->used;
+	block->used += size;
+	return memory;
+}
+
+void arena_reset(arena_t *arena)
+{
+	arena->current = arena->first;
+	arena->current->used = 0;
+}
+
+void arena_retain(arena_t *arena)
+{
+	__sync_add_and_fetch(&arena->reference_count, 1);
+}
+
+void arena_release(arena_t *arena)
+{
+	arena_block_t *block, *next;
+	
+	if (!arena || __sync_sub_and_fetch(&arena->reference_count, 1)) return;
+	for (block = arena->first; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	free(arena);
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2006-2015 Michael Roitzsch <mroi@os.inf.tu-dresden.de>
+ * economic rights: Technische Universitaet Dresden (Germany)
+ */
+
+#include <stddef.h>
+
+/* opaque handle for a region allocator: allocation is pointer bumping,
+ * and all allocations are released together instead of one by one */
+typedef struct arena_s arena_t;
+
+/* the new arena holds one reference */
+arena_t *arena_alloc(void);
+/* uninitialized memory suitably aligned for any type, lives until the arena is reset or freed */
+void *arena_push(arena_t *arena, size_t size);
+/* drops all allocations, but keeps the memory for reuse */
+void arena_reset(arena_t *arena);
+/* additional references keep the allocations alive, dropping the last one frees them;
+ * references may be taken and dropped on different threads, allocations may not */
+void arena_retain(arena_t *arena);
+void arena_release(arena_t *arena);
@@ -199,13 +199,13 @@ static inline int print_number(AVPicture *frame, int start_index, int end_index)
 {
 	static int number = 0;
 	
-	const int mb_y = start_index / proc.mb_width;
-	const int mb_x = start_index % proc.mb_width;
+	const int mb_y = start_index / proc->mb_width;
+	const int mb_x = start_index % proc->mb_width;
 	const int start_y = mb_y << mb_size_log;
 	const int start_x = mb_x << mb_size_log;
-	const int end_x = (end_index / proc.mb_width > mb_y) ?
-    proc.mb_width << mb_size_log :
-    (end_index % proc.mb_width) << mb_size_log;
+	const int end_x = (end_index / proc->mb_width > mb_y) ?
+    proc->mb_width << mb_size_log :
+    (end_index % proc->mb_width) << mb_size_log;
 	int x, y, decimal, digit_count, remain;
 	
 	for (decimal = 1; 10 * decimal <= number; decimal *= 10);
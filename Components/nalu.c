@@ -17,18 +17,61 @@
 
 struct nalu_read_s {
 	const uint8_t * restrict nalu;
-	uint_fast8_t byte;
+	/* upcoming bits, most significant first */
+	uint64_t cache;
 	uint_fast8_t bits;
+	/* emulation prevention state: zero bytes in a row */
+	uint_fast8_t zeros;
+	bool escaped;
+	/* layout version and values per slice from the header */
+	uint_fast8_t version;
+	uint_fast32_t fields, float_fields;
 };
 
+/* stdio buffer for the output file */
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+/* version 1 has no header, its slices always carry the 13 metrics */
+#define LEGACY_FIELDS 13
+
 struct nalu_write_s {
-	FILE *from, *to;
-	uint8_t buf[4096];
-	uint8_t history[3];
-	uint8_t byte;
+	/* demuxed packets not yet copied, starting at stream offset source_offset */
+	uint8_t *source;
+	size_t source_size, source_capacity, position;
+	uint64_t source_offset;
+	FILE *to;
+	uint64_t written;
+	/* source range accepted by copy_nalu(), but not yet written */
+	size_t copy_start, copy_end;
+	/* pending bits, least significant last */
+	uint64_t accumulator;
 	uint_fast8_t bits;
+	/* metadata NALU payload before and after emulation prevention */
+	uint8_t *payload, *escaped;
+	size_t size, capacity;
+	uint_fast8_t version;
+	/* only metadata NALUs are written, the source stays untouched */
+	bool sidecar;
+};
+
+struct nalu_sidecar_s {
+	FILE *from;
+	/* file contents from the current NALU onwards */
+	uint8_t *buffer;
+	size_t size, capacity, position;
+	bool end;
+	/* video and sidecar offsets of each frame from the index, and the frame whose NALU is next */
+	uint64_t *video, *metadata;
+	size_t frames, frame;
 };
 
+/* the escaped reader looks this far past the end of a NALU */
+#define SIDECAR_PADDING 8
+
+static const uint8_t start_code[4] = { 0x00, 0x00, 0x01, NAL_METADATA };
+
+static size_t find_start_code(const uint8_t *data, size_t begin, size_t end);
+static void flush_copy(nalu_write_t *write);
+
 static inline uint32_t reverse_bits(uint32_t x)
 {
 	x = ((x >>  1) & 0x55555555u) | ((x & 0x55555555u) <<  1);
@@ -49,35 +92,126 @@ nalu_read_t *nalu_read_alloc(void)
 	return malloc(sizeof(nalu_read_t));
 }
 
+static inline void nalu_read_refill(nalu_read_t *read)
+{
+	/* bytes are appended to the cache until it holds at least 57 bits;
+	 * this reads up to 8 bytes ahead, which the padding of FFmpeg's buffers covers */
+	while (read->bits <= 56) {
+		const uint8_t byte = *read->nalu++;
+		if (read->escaped) {
+			/* the 0x03 after two zero bytes was inserted by the writer, drop it */
+			if (read->zeros >= 2 && byte == 0x03) {
+				read->zeros = 0;
+				continue;
+			}
+			read->zeros = byte ? 0 : read->zeros + 1;
+		}
+		read->cache |= (uint64_t)byte << (56 - read->bits);
+		read->bits += 8;
+	}
+}
+
+static inline uint_fast32_t nalu_read_bits(nalu_read_t *read, uint_fast8_t count)
+{
+	assert(count > 0 && count <= 57);
+	if (read->bits < count)
+		nalu_read_refill(read);
+	
+	uint_fast32_t value = (uint_fast32_t)(read->cache >> (64 - count));
+	read->cache <<= count;
+	read->bits -= count;
+	return value;
+}
+
+static inline uint_fast32_t nalu_read_varint(nalu_read_t *read)
+{
+	/* seven bits per byte, least significant group first, the top bit flags continuation;
+	 * after a refill, the cache holds more than the five bytes of the longest varint */
+	if (read->bits < 40)
+		nalu_read_refill(read);
+	
+	uint64_t cache = read->cache;
+	uint_fast32_t value = 0, byte;
+	uint_fast8_t shift = 0;
+	do {
+		assert(shift <= 28);
+		byte = (uint_fast32_t)(cache >> 56);
+		cache <<= 8;
+		value |= (byte & 0x7F) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	
+	read->cache = cache;
+	read->bits -= (uint_fast8_t)(shift / 7 * 8);
+	return value;
+}
+
+static void nalu_read_header(nalu_read_t *read)
+{
+	nalu_read_refill(read);
+	/* version 1 starts with the exp-golomb coded frame width, which is never zero,
+	 * so its first bit is always 0, while later versions start with a set bit */
+	if (read->cache >> 63) {
+		read->version = (uint_fast8_t)(nalu_read_bits(read, 8) & 0x7F);
+		read->fields = nalu_read_varint(read);
+		read->float_fields = (read->version >= 3) ? nalu_read_varint(read) : 0;
+	} else {
+		read->version = 1;
+		read->fields = LEGACY_FIELDS;
+		read->float_fields = 0;
+	}
+}
+
 void nalu_read_start(nalu_read_t *read, const uint8_t *nalu)
 {
 	read->nalu = nalu;
-	read->byte = *nalu;
-	read->bits = 8;
+	read->cache = 0;
+	read->bits = 0;
+	read->zeros = 0;
+	read->escaped = false;
+	nalu_read_header(read);
 }
 
-static inline uint_fast8_t nalu_read_bit(nalu_read_t *read)
+void nalu_read_start_escaped(nalu_read_t *read, const uint8_t *nalu)
 {
-	uint_fast8_t bit = (read->byte >> 7) & 1;
-	read->byte <<= 1;
-	if (!(--read->bits)) {
-		read->nalu++;
-		read->byte = *read->nalu;
-		read->bits = 8;
-	}
-	return bit;
+	read->nalu = nalu;
+	read->cache = 0;
+	read->bits = 0;
+	read->zeros = 0;
+	read->escaped = true;
+	nalu_read_header(read);
+}
+
+uint_fast8_t nalu_read_version(const nalu_read_t *read)
+{
+	return read->version;
+}
+
+uint_fast32_t nalu_read_fields(const nalu_read_t *read)
+{
+	return read->fields;
+}
+
+uint_fast32_t nalu_read_float_fields(const nalu_read_t *read)
+{
+	return read->float_fields;
 }
 
 uint_fast32_t nalu_read_unsigned(nalu_read_t *read)
 {
-	size_t leading_zeros = 0;
-	while (nalu_read_bit(read) == 0)
-		leading_zeros++;
+	if (read->version >= 2)
+		return nalu_read_varint(read);
+	
+	if (read->bits < 32)
+		nalu_read_refill(read);
+	assert(read->cache != 0);
+	const uint_fast8_t leading_zeros = (uint_fast8_t)__builtin_clzll(read->cache);
 	assert(leading_zeros < 32);
 	
-	uint_fast32_t coded = 1;
-	while (leading_zeros--)
-		coded = (coded << 1) | nalu_read_bit(read);
+	/* skip the leading zeros and the marker bit, the payload follows */
+	nalu_read_bits(read, leading_zeros + 1);
+	if (!leading_zeros) return 0;
+	uint_fast32_t coded = ((uint_fast32_t)1 << leading_zeros) | nalu_read_bits(read, leading_zeros);
 	
 	return coded - 1;
 }
@@ -90,6 +224,18 @@ int_fast32_t nalu_read_signed(nalu_read_t *read)
 
 float nalu_read_float(nalu_read_t *read)
 {
+	if (read->version >= 2) {
+		/* IEEE single precision, little-endian */
+		union {
+			uint32_t in;
+			float out;
+		} convert;
+		convert.in = 0;
+		for (uint_fast8_t shift = 0; shift < 32; shift += 8)
+			convert.in |= (uint32_t)nalu_read_bits(read, 8) << shift;
+		return convert.out;
+	}
+	
 	uint32_t coded = (uint32_t)nalu_read_unsigned(read);
 	int32_t fixedpoint = (int32_t)reverse_bits(coded);
 	int32_t exponent = fixedpoint ? (int32_t)nalu_read_signed(read) : 0;
@@ -106,9 +252,12 @@ void nalu_read_free(nalu_read_t *read)
 
 #pragma mark Metadata NALU Writing
 
-nalu_write_t *nalu_write_alloc(const char *source)
+nalu_write_t *nalu_write_alloc(const char *source, bool sidecar)
 {
-	if (strcmp(&source[strlen(source) - sizeof(".h264") + 1], ".h264") != 0) {
+	/* a stream read from stdin is written to stdout */
+	const bool stream = (strcmp(source, "-") == 0);
+	if (!stream && (strlen(source) < sizeof(".h264") - 1 ||
+					strcmp(&source[strlen(source) - sizeof(".h264") + 1], ".h264") != 0)) {
 		fprintf(stderr, "filename does not have the proper .h264 ending\n");
 		abort();
 	}
@@ -116,65 +265,98 @@ nalu_write_t *nalu_write_alloc(const char *source)
 	nalu_write_t *write = malloc(sizeof(nalu_write_t));
 	if (!write) return NULL;
 	
-	char target[strlen(source) + sizeof("_" FILE_SUFFIX)];
-	sprintf(target, "%s_" FILE_SUFFIX, source);
-	write->from = fopen(source, "r");
-	write->to = fopen(target, "w");
+	char target[strlen(source) + sizeof("_" FILE_SUFFIX "_sidecar")];
+	sprintf(target, sidecar ? "%s_" FILE_SUFFIX "_sidecar" : "%s_" FILE_SUFFIX, source);
+	write->source = NULL;
+	write->source_size = write->source_capacity = write->position = 0;
+	write->source_offset = 0;
+	
+	write->to = stream ? stdout : fopen(target, "w");
+	/* collect output into large writes */
+	if (write->to)
+		setvbuf(write->to, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+	write->copy_start = write->copy_end = 0;
+	write->written = 0;
+	write->sidecar = sidecar;
+	
+	write->payload = NULL;
+	write->escaped = NULL;
+	write->capacity = 0;
 	
 	return write;
 }
 
-void nalu_write_start(nalu_write_t *write)
+static void nalu_write_grow(nalu_write_t *write)
 {
-	const uint8_t custom[4] = { 0x00, 0x00, 0x01, NAL_METADATA };
+	size_t capacity = write->capacity ? 2 * write->capacity : 4096;
+	/* escaping inserts at most one byte for every two payload bytes */
+	uint8_t *payload = realloc(write->payload, capacity);
+	uint8_t *escaped = payload ? realloc(write->escaped, sizeof(start_code) + capacity + capacity / 2 + 1) : NULL;
+	if (!payload || !escaped) {
+		fprintf(stderr, "could not allocate metadata NALU buffer\n");
+		abort();
+	}
+	write->payload = payload;
+	write->escaped = escaped;
+	write->capacity = capacity;
+}
+
+static inline void nalu_write_bits(nalu_write_t *write, uint_fast32_t value, uint_fast8_t count)
+{
+	assert(count <= 32);
+	assert(count == 32 || value < ((uint_fast32_t)1 << count));
 	
-	fwrite(custom, 1, 4, write->to);
-	write->history[2] = 0xFF;
-	write->byte = 0;
-	write->bits = 0;
+	/* the accumulator holds less than a byte between calls, so 32 more bits always fit */
+	write->accumulator = (write->accumulator << count) | value;
+	write->bits += count;
+	if (write->size + sizeof(uint64_t) > write->capacity)
+		nalu_write_grow(write);
+	while (write->bits >= 8) {
+		write->bits -= 8;
+		write->payload[write->size++] = (uint8_t)(write->accumulator >> write->bits);
+	}
 }
 
-static inline void nalu_write_bit(nalu_write_t *write, uint_fast8_t bit)
+void nalu_write_start(nalu_write_t *write, uint_fast8_t version, uint_fast32_t fields, uint_fast32_t float_fields)
 {
-	assert(bit == 0 || bit == 1);
+	assert(version >= 1 && version <= 3);
+	assert(version >= 3 || float_fields == 0);
 	
-	write->byte <<= 1;
-	write->byte |= bit;
-	if (++write->bits == 8) {
-		const uint8_t fill = 0x03;
-		
-		write->history[0] = write->history[1];
-		write->history[1] = write->history[2];
-		write->history[2] = write->byte;
-		/* the three byte sequences 0x000001, 0x000002 and 0x000003 are special in H.264 NAL;
-		 * if they do appear regularly, they must be disguised by inserting an extra 0x03 */
-		if (write->history[0] == 0 && write->history[1] == 0 && write->history[2] < 4) {
-			fwrite(&fill, 1, 1, write->to);
-			write->history[1] = 0xFF;
-		}
-		
-		fwrite(&write->byte, 1, 1, write->to);
-		write->byte = 0;
-		write->bits = 0;
+	write->accumulator = 0;
+	write->bits = 0;
+	write->size = 0;
+	write->version = version;
+	/* version 1 has no header, readers assume LEGACY_FIELDS values per slice */
+	if (version >= 2) {
+		/* the header's first byte is the version with the top bit set */
+		nalu_write_bits(write, 0x80 | version, 8);
+		nalu_write_unsigned(write, fields);
+		if (version >= 3)
+			nalu_write_unsigned(write, float_fields);
 	}
 }
 
+uint_fast8_t nalu_write_version(const nalu_write_t *write)
+{
+	return write->version;
+}
+
 void nalu_write_unsigned(nalu_write_t *write, uint_fast32_t value)
 {
 	assert(value < (1u << 31));
-	value = value + 1;
-	
-	uint_fast32_t temp = value;
-	size_t significant_bits = 0;
-	while (temp) {
-		significant_bits++;
-		temp >>= 1;
+	if (write->version >= 2) {
+		for (; value >= 0x80; value >>= 7)
+			nalu_write_bits(write, (value & 0x7F) | 0x80, 8);
+		nalu_write_bits(write, value, 8);
+		return;
 	}
-	for (size_t i = 1; i < significant_bits; i++)
-		nalu_write_bit(write, 0);
 	
-	while (significant_bits--)
-		nalu_write_bit(write, (value >> significant_bits) & 1);
+	value = value + 1;
+	
+	const uint_fast8_t significant_bits = (uint_fast8_t)(32 - __builtin_clz((uint32_t)value));
+	if (significant_bits > 1)
+		nalu_write_bits(write, 0, significant_bits - 1);
+	nalu_write_bits(write, value, significant_bits);
 }
 
 void nalu_write_signed(nalu_write_t *write, int_fast32_t value)
@@ -185,6 +367,17 @@ void nalu_write_signed(nalu_write_t *write, int_fast32_t value)
 
 void nalu_write_float(nalu_write_t *write, float value)
 {
+	if (write->version >= 2) {
+		union {
+			float in;
+			uint32_t out;
+		} convert;
+		convert.in = value;
+		for (uint_fast8_t shift = 0; shift < 32; shift += 8)
+			nalu_write_bits(write, (convert.out >> shift) & 0xFF, 8);
+		return;
+	}
+	
 	int exponent;
 	float magnitude = frexpf(value, &exponent);
 	assert(isfinite(magnitude));
@@ -200,12 +393,75 @@ void nalu_write_float(nalu_write_t *write, float value)
 void nalu_write_end(nalu_write_t *write)
 {
 	/* flush all remaining bits */
-	while (write->bits)
-		nalu_write_bit(write, 0);
+	if (write->bits)
+		nalu_write_bits(write, 0, 8 - write->bits);
+	if (!write->capacity)
+		nalu_write_grow(write);
+	
+	const uint8_t * restrict payload = write->payload;
+	uint8_t * restrict escaped = write->escaped;
+	const size_t size = write->size;
+	size_t zeros = 0, length = sizeof(start_code);
+	memcpy(escaped, start_code, sizeof(start_code));
+	
+	/* the three byte sequences 0x000001, 0x000002 and 0x000003 are special in H.264 NAL;
+	 * if they do appear regularly, they must be disguised by inserting an extra 0x03;
+	 * only zero bytes can start such a sequence, so the runs between them are copied in bulk */
+	for (size_t i = 0; i < size;) {
+		const uint8_t *zero = memchr(&payload[i], 0, size - i);
+		const size_t run_end = zero ? (size_t)(zero - payload) : size;
+		if (run_end > i) {
+			if (zeros >= 2 && payload[i] < 4)
+				escaped[length++] = 0x03;
+			memcpy(&escaped[length], &payload[i], run_end - i);
+			length += run_end - i;
+			zeros = 0;
+			i = run_end;
+		}
+		/* zero bytes one at a time, after an insertion the zero count starts over */
+		for (; i < size && payload[i] == 0; i++) {
+			if (zeros >= 2) {
+				escaped[length++] = 0x03;
+				zeros = 0;
+			}
+			escaped[length++] = 0;
+			zeros++;
+		}
+	}
+	
+	flush_copy(write);
+	fwrite(escaped, 1, length, write->to);
+	write->written += length;
+}
+
+void nalu_write_flush(nalu_write_t *write)
+{
+	flush_copy(write);
+	fflush(write->to);
+}
+
+uint64_t nalu_write_position(const nalu_write_t *write)
+{
+	return write->written + (write->copy_end - write->copy_start);
+}
+
+uint64_t nalu_copy_position(const nalu_write_t *write)
+{
+	if (write->sidecar)
+		return write->source_offset + write->position;
+	return nalu_write_position(write);
 }
 
 void nalu_write_free(nalu_write_t *write)
 {
+	flush_copy(write);
+	free(write->source);
+	if (write->to == stdout)
+		fflush(write->to);
+	else if (write->to)
+		fclose(write->to);
+	free(write->payload);
+	free(write->escaped);
 	free(write);
 }
 
@@ -214,49 +470,233 @@ void nalu_write_free(nalu_write_t *write)
 
 #pragma mark NALU Copying
 
-bool check_slice_start(nalu_write_t *write)
+/* position of the next 00 00 01 start code at or after begin, end if there is none */
+static size_t find_start_code(const uint8_t *data, size_t begin, size_t end)
+{
+	/* memchr() is vectorized, so look for the rare 0x01 byte and check the zeros before it */
+	for (size_t i = begin + 2; i < end;) {
+		const uint8_t *one = memchr(&data[i], 0x01, end - i);
+		if (!one) break;
+		const size_t found = (size_t)(one - data);
+		if (data[found - 1] == 0 && data[found - 2] == 0)
+			return found - 2;
+		i = found + 1;
+	}
+	return end;
+}
+
+static void flush_copy(nalu_write_t *write)
+{
+	const size_t start = write->copy_start;
+	const size_t end = write->copy_end;
+	write->copy_start = write->copy_end = 0;
+	if (start < end) {
+		fwrite(&write->source[start], 1, end - start, write->to);
+		write->written += end - start;
+	}
+}
+
+void queue_packet(nalu_write_t *write, const uint8_t *data, size_t size)
 {
-	while (1) {
-		/* peek ahead to get the start code */
-		if (fread(write->buf, 1, 4, write->from) != 4) {
-			fprintf(stderr, "could not read NALU start code\n");
-			fprintf(stderr, "source file position %jd\n", (intmax_t)ftello(write->from));
-			fprintf(stderr, "target file position %jd\n", (intmax_t)ftello(write->to));
+	/* drop what has been copied already, once it makes up the larger part of the buffer */
+	if (write->position && write->position >= write->source_size - write->position) {
+		flush_copy(write);
+		memmove(write->source, &write->source[write->position], write->source_size - write->position);
+		write->source_size -= write->position;
+		write->source_offset += write->position;
+		write->position = 0;
+	}
+	
+	if (write->source_size + size > write->source_capacity) {
+		size_t capacity = write->source_capacity ? write->source_capacity : OUTPUT_BUFFER_SIZE;
+		while (capacity < write->source_size + size)
+			capacity *= 2;
+		uint8_t *source = realloc(write->source, capacity);
+		if (!source) {
+			fprintf(stderr, "could not allocate packet buffer\n");
 			abort();
 		}
-		fseek(write->from, -4, SEEK_CUR);
-		if (write->buf[0] == 0 && write->buf[1] == 0 && write->buf[2] == 1)
-			break;
-		else
-			return false;
+		write->source = source;
+		write->source_capacity = capacity;
 	}
-	return ((write->buf[3] & 0x1F) > 0 && (write->buf[3] & 0x1F) < 6);
+	
+	memcpy(&write->source[write->source_size], data, size);
+	write->source_size += size;
+}
+
+bool check_slice_start(nalu_write_t *write)
+{
+	if (write->position + 4 > write->source_size) {
+		flush_copy(write);
+		fprintf(stderr, "could not read NALU start code\n");
+		fprintf(stderr, "source file position %jd\n", (intmax_t)(write->source_offset + write->position));
+		fprintf(stderr, "target file position %jd\n", (intmax_t)ftello(write->to));
+		abort();
+	}
+	const uint8_t *nalu = &write->source[write->position];
+	if (nalu[0] != 0 || nalu[1] != 0 || nalu[2] != 1)
+		return false;
+	return ((nalu[3] & 0x1F) > 0 && (nalu[3] & 0x1F) < 6);
 }
 
 void copy_nalu(nalu_write_t *write)
 {
-	size_t write_bytes, read_bytes;
+	const uint8_t *nalu = &write->source[write->position];
 	/* skip our own NALUs, if the file has already been preprocessed */
 	const int skip =
-		(write->buf[0] == 0) &&
-		(write->buf[1] == 0) &&
-		(write->buf[2] == 1) &&
-		((write->buf[3] & 0x1F) == NAL_METADATA);
-	
-	/* the start bytes are alredy in the buffer, take them from there and skip them in the file */
-	if (!skip)
-		fwrite(write->buf, 1, 4, write->to);
-	fseek(write->from, 4, SEEK_CUR);
-	do {
-		read_bytes = fread(write->buf, 1, sizeof(write->buf), write->from);
-		for (write_bytes = 0; write_bytes < read_bytes - 2; write_bytes++)
-			if (write->buf[write_bytes] == 0 && write->buf[write_bytes+1] == 0 && write->buf[write_bytes+2] == 1)
-				break;
-		if (feof(write->from) && write_bytes == read_bytes - 2)
-			// last NALU, write everything
-			write_bytes = read_bytes;
-		if (!skip)
-			fwrite(write->buf, 1, write_bytes, write->to);
-		fseek(write->from, (long)(write_bytes - read_bytes), SEEK_CUR);
-	} while (write_bytes == read_bytes - 2);
+		(nalu[0] == 0) &&
+		(nalu[1] == 0) &&
+		(nalu[2] == 1) &&
+		((nalu[3] & 0x1F) == NAL_METADATA);
+	
+	/* the NALU extends from its four start bytes to the next start code or the end of the queued data */
+	const size_t begin = write->position;
+	const size_t end = find_start_code(write->source, begin + 4, write->source_size);
+	write->position = end;
+	if (skip || write->sidecar) return;
+	
+	/* adjacent NALUs are collected and copied in one go */
+	if (write->copy_end != begin) {
+		flush_copy(write);
+		write->copy_start = begin;
+	}
+	write->copy_end = end;
+}
+
+#pragma mark -
+
+
+#pragma mark Metadata Sidecar Reading
+
+static bool load_index(nalu_sidecar_t *sidecar, const char *index)
+{
+	FILE *from = fopen(index, "r");
+	uint8_t record[INDEX_RECORD_SIZE];
+	size_t capacity = 0;
+	
+	if (!from) return false;
+	while (fread(record, 1, INDEX_RECORD_SIZE, from) == INDEX_RECORD_SIZE) {
+		if (sidecar->frames == capacity) {
+			capacity = capacity ? 2 * capacity : 1024;
+			uint64_t *video = realloc(sidecar->video, capacity * sizeof(uint64_t));
+			if (video) sidecar->video = video;
+			uint64_t *metadata = realloc(sidecar->metadata, capacity * sizeof(uint64_t));
+			if (metadata) sidecar->metadata = metadata;
+			if (!video || !metadata) {
+				fclose(from);
+				return false;
+			}
+		}
+		/* the index is big-endian, the frame's video offset comes first, its metadata offset second */
+		uint64_t video = 0, metadata = 0;
+		for (size_t i = 0; i < 8; i++) {
+			video    = (video    << 8) | record[i];
+			metadata = (metadata << 8) | record[8 + i];
+		}
+		sidecar->video[sidecar->frames] = video;
+		sidecar->metadata[sidecar->frames] = metadata;
+		sidecar->frames++;
+	}
+	fclose(from);
+	return true;
+}
+
+nalu_sidecar_t *nalu_sidecar_open(const char *filename, const char *index)
+{
+	FILE *from = fopen(filename, "r");
+	if (!from) return NULL;
+	
+	nalu_sidecar_t *sidecar = malloc(sizeof(nalu_sidecar_t));
+	if (!sidecar) {
+		fclose(from);
+		return NULL;
+	}
+	sidecar->from = from;
+	sidecar->buffer = NULL;
+	sidecar->size = sidecar->capacity = sidecar->position = 0;
+	sidecar->end = false;
+	sidecar->video = sidecar->metadata = NULL;
+	sidecar->frames = sidecar->frame = 0;
+	if (index && !load_index(sidecar, index)) {
+		nalu_sidecar_close(sidecar);
+		return NULL;
+	}
+	
+	return sidecar;
+}
+
+bool nalu_sidecar_seek(nalu_sidecar_t *sidecar, int64_t video_offset)
+{
+	if (video_offset < 0 || !sidecar->frames) return false;
+	/* packet positions may be off the recorded frame starts by the zero bytes of a start code */
+	const uint64_t offset = (uint64_t)video_offset + 4;
+	if (offset < sidecar->video[0]) return false;
+	
+	/* the last frame starting at or before the offset */
+	size_t low = 0, high = sidecar->frames;
+	while (high - low > 1) {
+		const size_t middle = low + (high - low) / 2;
+		if (sidecar->video[middle] <= offset)
+			low = middle;
+		else
+			high = middle;
+	}
+	
+	if (low != sidecar->frame) {
+		if (fseeko(sidecar->from, (off_t)sidecar->metadata[low], SEEK_SET) != 0)
+			return false;
+		sidecar->size = sidecar->position = 0;
+		sidecar->end = false;
+		sidecar->frame = low;
+	}
+	return true;
+}
+
+const uint8_t *nalu_sidecar_next(nalu_sidecar_t *sidecar)
+{
+	size_t next;
+	
+	/* the NALU must be buffered completely, up to the following start code or the end of the file */
+	while ((next = find_start_code(sidecar->buffer, sidecar->position + 4, sidecar->size)) == sidecar->size && !sidecar->end) {
+		if (sidecar->position) {
+			memmove(sidecar->buffer, &sidecar->buffer[sidecar->position], sidecar->size - sidecar->position);
+			sidecar->size -= sidecar->position;
+			sidecar->position = 0;
+		}
+		if (sidecar->capacity - sidecar->size < OUTPUT_BUFFER_SIZE / 2) {
+			const size_t capacity = sidecar->capacity ? 2 * sidecar->capacity : OUTPUT_BUFFER_SIZE;
+			uint8_t *buffer = realloc(sidecar->buffer, capacity + SIDECAR_PADDING);
+			if (!buffer) {
+				fprintf(stderr, "could not allocate sidecar buffer\n");
+				abort();
+			}
+			sidecar->buffer = buffer;
+			sidecar->capacity = capacity;
+		}
+		const size_t request = sidecar->capacity - sidecar->size;
+		const size_t got = fread(&sidecar->buffer[sidecar->size], 1, request, sidecar->from);
+		sidecar->size += got;
+		sidecar->end = (got < request);
+	}
+	
+	const size_t begin = sidecar->position;
+	if (begin + sizeof(start_code) > sidecar->size)
+		return NULL;
+	if (memcmp(&sidecar->buffer[begin], start_code, sizeof(start_code)) != 0) {
+		fprintf(stderr, "sidecar file has no metadata NALU at offset %zu\n", begin);
+		abort();
+	}
+	memset(&sidecar->buffer[sidecar->size], 0, SIDECAR_PADDING);
+	sidecar->position = next;
+	sidecar->frame++;
+	return &sidecar->buffer[begin + sizeof(start_code)];
+}
+
+void nalu_sidecar_close(nalu_sidecar_t *sidecar)
+{
+	fclose(sidecar->from);
+	free(sidecar->buffer);
+	free(sidecar->video);
+	free(sidecar->metadata);
+	free(sidecar);
 }
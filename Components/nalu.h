@@ -3,6 +3,7 @@
  * economic rights: Technische Universitaet Dresden (Germany)
  */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -13,26 +14,61 @@
 /* opaque handles for NALU access */
 typedef struct nalu_read_s nalu_read_t;
 typedef struct nalu_write_s nalu_write_t;
+typedef struct nalu_sidecar_s nalu_sidecar_t;
 
-/* metadata storage uses exp-golomb coding */
+/* metadata storage layouts: version 1 is bit-packed exp-golomb coding, version 2 starts with
+ * a header giving the number of values per slice and uses byte-aligned varints and IEEE floats;
+ * version 3 codes the replacement quadtree with split flags packed seven to a varint byte
+ * instead of per-leaf depths, and its header also counts the floats that follow the unsigned
+ * values of each slice, so readers can skip values they do not know; the reader handles all of them */
+#define METADATA_VERSION 3
 
 /* metadata NALU reading */
 nalu_read_t *nalu_read_alloc(void);
+/* the NALU payload after the header byte, with emulation prevention already removed */
 void nalu_read_start(nalu_read_t *read, const uint8_t *nalu);
+/* the NALU payload as stored in the bitstream, emulation prevention bytes are skipped */
+void nalu_read_start_escaped(nalu_read_t *read, const uint8_t *nalu);
+uint_fast8_t nalu_read_version(const nalu_read_t *read);
+/* number of unsigned values and of floats following them per slice */
+uint_fast32_t nalu_read_fields(const nalu_read_t *read);
+uint_fast32_t nalu_read_float_fields(const nalu_read_t *read);
 uint_fast32_t nalu_read_unsigned(nalu_read_t *read);
 int_fast32_t nalu_read_signed(nalu_read_t *read);
 float nalu_read_float(nalu_read_t *read);
 void nalu_read_free(nalu_read_t *read);
 
 /* metadata NALU writing */
-nalu_write_t *nalu_write_alloc(const char *filename);
-void nalu_write_start(nalu_write_t *write);
+/* a sidecar receives only the metadata NALUs, one per frame in decoding order, and no copied source NALUs */
+nalu_write_t *nalu_write_alloc(const char *filename, bool sidecar);
+void nalu_write_start(nalu_write_t *write, uint_fast8_t version, uint_fast32_t fields, uint_fast32_t float_fields);
+uint_fast8_t nalu_write_version(const nalu_write_t *write);
 void nalu_write_unsigned(nalu_write_t *write, uint_fast32_t value);
 void nalu_write_signed(nalu_write_t *write, int_fast32_t value);
 void nalu_write_float(nalu_write_t *write, float value);
 void nalu_write_end(nalu_write_t *write);
+/* hands everything written so far to the output, call at a point where consumers can pick up */
+void nalu_write_flush(nalu_write_t *write);
+/* output offset of the next byte to be written */
+uint64_t nalu_write_position(const nalu_write_t *write);
+/* offset of the next NALU to be copied in the video it ends up in, which is the untouched source for a sidecar */
+uint64_t nalu_copy_position(const nalu_write_t *write);
 void nalu_write_free(nalu_write_t *write);
 
-/* NALU copying */
+/* NALU copying, the source stream is fed as demuxed packets */
+void queue_packet(nalu_write_t *write, const uint8_t *data, size_t size);
 bool check_slice_start(nalu_write_t *write);
 void copy_nalu(nalu_write_t *write);
+
+/* size of a frame's record in the random access index written alongside the metadata */
+#define INDEX_RECORD_SIZE 40
+/* size of a slice's entry in the slice table accompanying the index */
+#define INDEX_SLICE_SIZE 4
+
+/* metadata sidecar reading, returns the next frame's NALU for nalu_read_start_escaped() or NULL at the end */
+nalu_sidecar_t *nalu_sidecar_open(const char *filename, const char *index);
+/* with an index, the sidecar can follow the video to the frame containing the given byte offset;
+ * returns false without an index or for offsets the index does not cover */
+bool nalu_sidecar_seek(nalu_sidecar_t *sidecar, int64_t video_offset);
+const uint8_t *nalu_sidecar_next(nalu_sidecar_t *sidecar);
+void nalu_sidecar_close(nalu_sidecar_t *sidecar);
@@ -12,42 +12,60 @@
 #include "process.h"
 
 static void process_slice(AVCodecContext *c);
-#if METADATA_READ
+static int handle_slice(const AVCodecContext *c);
+#if FRAME_THREADS
+static void record_slice(AVCodecContext *c);
+static void destroy_recorders(void);
+#endif
+#if METADATA_READ && !METADATA_SIDECAR
 static void process_metadata(const uint8_t *);
 #endif
+#if METADATA_READ && METADATA_SIDECAR
+static void process_sidecar(void);
+#endif
+#if METADATA_READ
+static void read_metadata(void);
+#endif
 #if METADATA_WRITE
 static void write_metadata(void);
+static void write_index(uint32_t idr, uint64_t frame, uint64_t metadata, uint64_t propagation,
+						uint64_t slices, size32_t slice_count);
+static void write_index_slice(uint32_t slice);
+static inline uint64_t get_big_endian(const uint8_t *buf, size_t bytes);
+static void rebase_index(uint8_t *record, uint8_t *slice, uint32_t idr_base, uint64_t slices_base,
+						 uint64_t video_base, uint64_t video_skip,
+						 uint64_t output_base, uint64_t output_skip, uint64_t propagation_base);
+static uint64_t append_file(FILE *to, FILE *from);
+static char *metadata_file(const char *file, const char *suffix);
+#endif
+#if (METADATA_WRITE && PREPROCESS) || (METADATA_READ && !PREPROCESS && (SCHEDULING_METHOD == LIFETIME))
+static char *propagation_file(const char *file);
 #endif
 static void resize_storage(size32_t mb_width, size32_t mb_height);
 static void setup_frame(const AVCodecContext *c);
+static void reserve_slices(frame_node_t *frame, size32_t count);
+static void destroy_frame(frame_node_t *frame);
 static void destroy_frames_list(void);
 
-struct proc_s proc = {
-.last_idr = NULL, .frame = NULL,
-#ifdef SCHEDULE_EXECUTE
-.propagation = { .vis_frame = { .data = { NULL, NULL, NULL, NULL } }, .total_error = 0.0 },
-#endif
-#ifdef SCHEDULE_EXECUTE
-.schedule = { .first_to_drop = -1 },
-#endif
-#if PREPROCESS
-.temp_frame = { .data = { NULL, NULL, NULL, NULL } },
-#endif
-.mb_width = 0, .mb_height = 0
-};
+__thread struct proc_s *proc = NULL;
 
 
 void process_init(AVCodecContext *c, const char *file)
 {
-	// FIXME: we need to be single-threaded for now
+#if FRAME_THREADS
+	/* only frame threading is supported, each frame thread has a decoder context of its own,
+	 * while FFmpeg's slice threads would share the per-slice hook state of one context */
+	c->thread_type = FF_THREAD_FRAME;
+#else
 	c->thread_count = 1;
+#endif
 	memset(&c->metrics,   0, sizeof(c->metrics  ));
 	memset(&c->timing ,   0, sizeof(c->timing   ));
 	memset(&c->slice,     0, sizeof(c->slice    ));
 	memset(&c->reference, 0, sizeof(c->reference));
 	memset(&c->frame,     0, sizeof(c->frame    ));
 	c->process_slice = (void (*)(void *))process_slice;
-#if METADATA_READ
+#if METADATA_READ && !METADATA_SIDECAR
 	c->process_metadata = process_metadata;
 #else
 	c->process_metadata = NULL;
@@ -56,59 +74,310 @@ void process_init(AVCodecContext *c, const char *file)
 		c->get_buffer = frame_storage_alloc;
 	if (frame_storage_destroy)
 		c->release_buffer = frame_storage_destroy;
-	srandom(0);
+	/* every decoder carries its own context, all pointers start out NULL,
+	 * the SSIM samplings start from seed zero, so repeated runs decide alike */
+	proc = calloc(1, sizeof(struct proc_s));
+	if (!proc) {
+		printf("could not allocate the processing context\n");
+		exit(1);
+	}
+	c->opaque = proc;
+#if FRAME_THREADS
+	pthread_mutex_init(&proc->threads.lock, NULL);
+	pthread_cond_init(&proc->threads.turn, NULL);
+	/* FFmpeg numbers the coded pictures from zero */
+	proc->threads.next = 0;
+	proc->threads.busy = false;
+#endif
+#ifdef SCHEDULE_EXECUTE
+	proc->schedule.first_to_drop = -1;
+#endif
+#ifdef FINAL_SCHEDULING
+	proc->schedule.frame_duration = -1.0;
+	proc->schedule.frame_deadline = -1.0;
+#endif
+#if PREPROCESS
+	proc->search = arena_alloc();
+#endif
+#if PREPROCESS && PYRAMID_SSIM
+	proc->ssim_pyramid = ssim_pyramid_alloc(pyramid_levels);
+#endif
 #if METADATA_READ
-	proc.metadata.read = nalu_read_alloc();
+	proc->metadata.read = nalu_read_alloc();
+#endif
+#if METADATA_READ && METADATA_SIDECAR
+	if (strcmp(file, "-") == 0) {
+		/* streams have no name to derive the sidecar file from */
+		const char *const envvar = getenv("SIDECAR");
+		proc->metadata.sidecar = envvar ? nalu_sidecar_open(envvar, NULL) : NULL;
+	} else {
+		char *sidecarfile = malloc(strlen(file) + sizeof("_" FILE_SUFFIX "_sidecar"));
+		sprintf(sidecarfile, "%s_" FILE_SUFFIX "_sidecar", file);
+		proc->metadata.sidecar = nalu_sidecar_open(sidecarfile, NULL);
+		free(sidecarfile);
+	}
+	if (!proc->metadata.sidecar) {
+		printf("could not open the metadata sidecar\n");
+		exit(1);
+	}
+	proc->metadata.sidecar_pending = false;
 #endif
 #if METADATA_WRITE
-	proc.metadata.write = nalu_write_alloc(file);
+	proc->metadata.write = nalu_write_alloc(file, METADATA_SIDECAR);
+#if FRAME_THREADS
+	pthread_mutex_init(&proc->metadata.packets, NULL);
+#endif
+	if (strcmp(file, "-") == 0) {
+		/* like the propagation file, the index of a stream is optional */
+		const char *const envvar = getenv("INDEX");
+		proc->metadata.index = envvar ? fopen(envvar, "w") : NULL;
+		if (proc->metadata.index) {
+			char *slicesfile = metadata_file(envvar, "_slices");
+			proc->metadata.index_slices = fopen(slicesfile, "w");
+			free(slicesfile);
+		}
+	} else {
+		char *indexfile = metadata_file(file, "_" FILE_SUFFIX "_index");
+		char *slicesfile = metadata_file(indexfile, "_slices");
+		proc->metadata.index = fopen(indexfile, "w");
+		proc->metadata.index_slices = proc->metadata.index ? fopen(slicesfile, "w") : NULL;
+		free(indexfile);
+		free(slicesfile);
+	}
+	if (proc->metadata.index && !proc->metadata.index_slices) {
+		/* an index without its slice table is useless */
+		fclose(proc->metadata.index);
+		proc->metadata.index = NULL;
+	}
+	proc->metadata.index_frames = 0;
+	proc->metadata.index_slice_entries = 0;
 #else
 	(void)file;
 #endif
 #if (METADATA_WRITE && PREPROCESS) || (METADATA_READ && !PREPROCESS && (SCHEDULING_METHOD == LIFETIME))
-	size_t length = strlen(file);
-	if (strcmp(&file[length - sizeof("264") + 1], "264") == 0) {
-		char *propfile = strdup(file);
-		propfile[length - sizeof("p264") + 1] = 'p';
-		propfile[length - sizeof("p264") + 2] = 'r';
-		propfile[length - sizeof("p264") + 3] = 'o';
-		propfile[length - sizeof("p264") + 4] = 'p';
-		proc.metadata.propagation = fopen(propfile,
+	char *propfile = propagation_file(file);
+	if (propfile)
+		proc->metadata.propagation = fopen(propfile,
 #if METADATA_READ
 										  "r"
 #else
 										  "w"
 #endif
 										  );
-	} else {
-		printf("filename does not have the proper .?264 ending\n");
+#if METADATA_READ && !PREPROCESS && (SCHEDULING_METHOD == LIFETIME)
+	if (proc->metadata.propagation &&
+		!(proc->metadata.propagation_version = read_immission_header(proc->metadata.propagation))) {
+		printf("unsupported version of the propagation file %s\n", propfile);
 		exit(1);
 	}
+#elif !METADATA_READ
+	if (proc->metadata.propagation)
+		write_immission_header(proc->metadata.propagation);
+#endif
+	free(propfile);
 #endif
 	FFMPEG_TIME_START(c, total);
 }
 
+void process_packet(AVCodecContext *c, const AVPacket *packet)
+{
+	/* the metadata callback has no decoder argument and relies on this binding */
+	proc = c->opaque;
+#if METADATA_WRITE
+	/* the output stream is assembled from the packets, the source file is not read again */
+#if FRAME_THREADS
+	pthread_mutex_lock(&proc->metadata.packets);
+#endif
+	queue_packet(proc->metadata.write, packet->data, (size_t)packet->size);
+#if FRAME_THREADS
+	pthread_mutex_unlock(&proc->metadata.packets);
+#endif
+#else
+	(void)packet;
+#endif
+}
+
 void process_finish(AVCodecContext *c)
 {
-	(void)c;
+	proc = c->opaque;
 #if PREPROCESS
-	accumulate_quality_loss(proc.last_idr);
+	accumulate_quality_loss(proc->last_idr);
 #endif
 #if METADATA_READ
-	nalu_read_free(proc.metadata.read);
+	nalu_read_free(proc->metadata.read);
+#endif
+#if METADATA_READ && METADATA_SIDECAR
+	nalu_sidecar_close(proc->metadata.sidecar);
 #endif
 #if METADATA_WRITE
 	// flush remaining frames
 	write_metadata();
-	nalu_write_free(proc.metadata.write);
+	nalu_write_free(proc->metadata.write);
+	if (proc->metadata.index) fclose(proc->metadata.index);
+	if (proc->metadata.index_slices) fclose(proc->metadata.index_slices);
+#if FRAME_THREADS
+	pthread_mutex_destroy(&proc->metadata.packets);
+#endif
 #endif
 #if (METADATA_WRITE && PREPROCESS) || (METADATA_READ && !PREPROCESS && (SCHEDULING_METHOD == LIFETIME))
-	if (proc.metadata.propagation) fclose(proc.metadata.propagation);
+	if (proc->metadata.propagation) fclose(proc->metadata.propagation);
 #endif
-	while (proc.last_idr)
+	while (proc->last_idr)
 		destroy_frames_list();
+#if PREPROCESS
+	arena_release(proc->search);
+	avpicture_free(&proc->temp_frame);
+	av_free(proc->ref_num[0]);
+	av_free(proc->ref_num[1]);
+	av_free(proc->patches);
+	av_free(proc->variant_patches);
+	av_free(proc->slice_map);
+	av_free(proc->immission);
+#endif
+#if PREPROCESS && PYRAMID_SSIM
+	ssim_pyramid_free(proc->ssim_pyramid);
+#endif
+#if PREPROCESS && PYRAMID_REPORT
+	fprintf(stderr, "%u subdivision decisions on reduced resolution, %u refined, %u of the unrefined differ from full resolution\n",
+			proc->pyramid.estimated, proc->pyramid.refined, proc->pyramid.differing);
+#endif
 #ifdef SCHEDULE_EXECUTE
-	printf("%lf\n", proc.propagation.total_error);
+	printf("%lf\n", proc->propagation.total_error);
+	if (proc->propagation.original) fclose(proc->propagation.original);
+	if (proc->propagation.vis) fclose(proc->propagation.vis);
+	avpicture_free(&proc->propagation.vis_frame);
+#endif
+#if FRAME_THREADS
+	destroy_recorders();
+	pthread_cond_destroy(&proc->threads.turn);
+	pthread_mutex_destroy(&proc->threads.lock);
+#endif
+	free(proc);
+	c->opaque = NULL;
+	proc = NULL;
+}
+
+bool process_mergeable(void)
+{
+	/* parts read their own metadata, which would have to be split up front */
+	return METADATA_WRITE && !METADATA_READ;
+}
+
+void process_merge(const char *file, const process_part_t *part, size_t count)
+{
+#if METADATA_WRITE
+	const char *const suffix = METADATA_SIDECAR ? "_" FILE_SUFFIX "_sidecar" : "_" FILE_SUFFIX;
+	char *outfile = metadata_file(file, suffix);
+	char *indexfile = metadata_file(file, "_" FILE_SUFFIX "_index");
+	char *slicesfile = metadata_file(indexfile, "_slices");
+	FILE *output = fopen(outfile, "w");
+	FILE *index = fopen(indexfile, "w");
+	FILE *index_slices = fopen(slicesfile, "w");
+	/* the slices of a single frame, of which there are at most SLICE_LIMIT */
+	uint8_t *slice = malloc(SLICE_LIMIT * INDEX_SLICE_SIZE);
+	free(outfile);
+	free(indexfile);
+	free(slicesfile);
+#if PREPROCESS
+	char *propfile = propagation_file(file);
+	FILE *propagation = propfile ? fopen(propfile, "w") : NULL;
+	free(propfile);
+	/* the merged file has a single header, those of the parts are skipped */
+	if (propagation)
+		write_immission_header(propagation);
+#endif
+	if (!output || !slice) {
+		printf("could not open the metadata output\n");
+		exit(1);
+	}
+	if (!index || !index_slices) {
+		/* an index without its slice table is useless */
+		if (index) fclose(index);
+		if (index_slices) fclose(index_slices);
+		index = index_slices = NULL;
+	}
+	
+	uint64_t output_base = 0, propagation_base = 0, slices_base = 0;
+	uint32_t idr_base = 0;
+	for (size_t i = 0; i < count; i++) {
+		/* a sidecar has no copied NALUs, so the bytes ahead of the part only show in the video */
+		const uint64_t output_skip = METADATA_SIDECAR ? 0 : part[i].skip;
+		uint64_t output_size = 0, propagation_size = 0, slice_entries = 0;
+		uint32_t frames = 0;
+		
+		char *partfile = metadata_file(part[i].file, suffix);
+		FILE *from = fopen(partfile, "r");
+		if (!from || fseeko(from, (off_t)output_skip, SEEK_SET) != 0) {
+			printf("could not read the metadata output of %s\n", part[i].file);
+			exit(1);
+		}
+		output_size = append_file(output, from);
+		fclose(from);
+		remove(partfile);
+		free(partfile);
+		
+		partfile = metadata_file(part[i].file, "_" FILE_SUFFIX "_index");
+		char *partslices = metadata_file(partfile, "_slices");
+		from = fopen(partfile, "r");
+		FILE *from_slices = fopen(partslices, "r");
+		if (from && from_slices) {
+			uint8_t record[INDEX_RECORD_SIZE];
+			const uint64_t video_base = METADATA_SIDECAR ? part[i].start : output_base;
+			while (fread(record, 1, INDEX_RECORD_SIZE, from) == INDEX_RECORD_SIZE) {
+				/* the slice lists are stored in frame order, so they are read alongside the records */
+				const size32_t slice_count = (size32_t)get_big_endian(&record[36], 4);
+				if (slice_count > SLICE_LIMIT ||
+					fread(slice, INDEX_SLICE_SIZE, slice_count, from_slices) != slice_count) {
+					printf("corrupt index of %s\n", part[i].file);
+					exit(1);
+				}
+				rebase_index(record, slice, idr_base, slices_base + slice_entries, video_base, part[i].skip,
+							 output_base, output_skip, propagation_base);
+				if (index) {
+					fwrite(record, 1, INDEX_RECORD_SIZE, index);
+					fwrite(slice, INDEX_SLICE_SIZE, slice_count, index_slices);
+				}
+				slice_entries += slice_count;
+				frames++;
+			}
+		}
+		if (from) fclose(from);
+		if (from_slices) fclose(from_slices);
+		remove(partfile);
+		remove(partslices);
+		free(partfile);
+		free(partslices);
+		
+#if PREPROCESS
+		partfile = propagation_file(part[i].file);
+		from = partfile ? fopen(partfile, "r") : NULL;
+		if (from) {
+			/* the index offsets of a part count its header, the bytes appended do not */
+			if (propagation && fseeko(from, PROPAGATION_HEADER_SIZE, SEEK_SET) == 0)
+				propagation_size = append_file(propagation, from);
+			fclose(from);
+			remove(partfile);
+		}
+		free(partfile);
+#endif
+		
+		output_base += output_size;
+		propagation_base += propagation_size;
+		slices_base += slice_entries;
+		idr_base += frames;
+	}
+	
+	free(slice);
+	fclose(output);
+	if (index) fclose(index);
+	if (index_slices) fclose(index_slices);
+#if PREPROCESS
+	if (propagation) fclose(propagation);
+#endif
+#else
+	(void)file;
+	(void)part;
+	(void)count;
 #endif
 }
 
@@ -116,7 +385,36 @@ static void process_slice(AVCodecContext *c)
 {
 	int skip_slice = 0;
 	
+	proc = c->opaque;
 	FFMPEG_TIME_STOP(c, total);
+#if FRAME_THREADS
+	/* frame threads defer the processing, so nothing is fed back to the decoder */
+	if (c->active_thread_type & FF_THREAD_FRAME)
+		record_slice(c);
+	else
+		skip_slice = handle_slice(c);
+#else
+	skip_slice = handle_slice(c);
+#endif
+	
+	memset(&c->metrics,   0, sizeof(c->metrics  ));
+	memset(&c->timing ,   0, sizeof(c->timing   ));
+	memset(&c->slice,     0, sizeof(c->slice    ));
+	
+	/* pass skipping hint to FFmpeg so it can drop the decoding of the upcoming slice */
+	c->slice.skip    = skip_slice;
+#ifdef SCHEDULE_EXECUTE
+	c->slice.conceal = proc->schedule.conceal;
+#endif
+	
+	FFMPEG_TIME_START(c, total);
+}
+
+/* the processing of one hook call, returns whether to skip the upcoming slice */
+static int handle_slice(const AVCodecContext *c)
+{
+	int skip_slice = 0;
+	
 	if (hook_slice_any) hook_slice_any(c);
 	
 	switch (c->metrics.type) {
@@ -125,7 +423,7 @@ static void process_slice(AVCodecContext *c)
 			if (c->frame.flag_idr) {
 				/* flush frame list on IDR */
 #if PREPROCESS
-				accumulate_quality_loss(proc.last_idr);
+				accumulate_quality_loss(proc->last_idr);
 #endif
 #if METADATA_WRITE
 				write_metadata();
@@ -134,6 +432,9 @@ static void process_slice(AVCodecContext *c)
 			}
 			resize_storage(c->frame.mb_width, c->frame.mb_height);
 			setup_frame(c);
+#if METADATA_READ && METADATA_SIDECAR
+			proc->metadata.sidecar_pending = true;
+#endif
 #if SLICE_SKIP
 			skip_slice = perform_slice_skip(c);
 #endif
@@ -141,7 +442,12 @@ static void process_slice(AVCodecContext *c)
 			
 		case PSEUDO_SLICE_FRAME_END:
 			/* pseudo slice at the end of the frame, after the last real slice finished */
-			if (!proc.frame) break;
+			if (!proc->frame) break;
+			proc->slice_hint = proc->frame->slice_count;
+#if METADATA_READ && METADATA_SIDECAR
+			/* an interleaved metadata NALU follows the last slice, so it would have been processed by now */
+			process_sidecar();
+#endif
 			if (hook_frame_end) hook_frame_end(c);
 #ifdef SCHEDULE_EXECUTE
 			propagation_visualize(c);
@@ -150,7 +456,10 @@ static void process_slice(AVCodecContext *c)
 			
 		default:
 			/* regular slice */
-			if (!proc.frame) break;
+			if (!proc->frame) break;
+#if !METADATA_READ || METRICS_EXTRACT || PREPROCESS
+			reserve_slices(proc->frame, proc->frame->slice_count + 1);
+#endif
 #if METRICS_EXTRACT
 			remember_metrics(c);
 #endif
@@ -160,14 +469,11 @@ static void process_slice(AVCodecContext *c)
 			remember_dependencies(c);
 #endif
 #if !METADATA_READ || METRICS_EXTRACT || PREPROCESS
-			if (++proc.frame->slice_count == SLICE_MAX) {
-				printf("ERROR: maximum number of slices exceeded\n");
-				exit(1);
-			}
+			proc->frame->slice_count++;
 #endif
 			if (c->slice.flag_last) {
 #if PREPROCESS
-				search_replacements(c, proc.frame->replacement);
+				search_replacements(c, proc->frame->replacement);
 #endif
 			}
 #if SLICE_SKIP
@@ -177,72 +483,294 @@ static void process_slice(AVCodecContext *c)
 	
 	if (hook_slice_end) hook_slice_end(c);
 	
-	memset(&c->metrics,   0, sizeof(c->metrics  ));
-	memset(&c->timing ,   0, sizeof(c->timing   ));
-	memset(&c->slice,     0, sizeof(c->slice    ));
+	return skip_slice;
+}
+
+#if FRAME_THREADS
+/* The hook calls of a frame thread are recorded as the decoder state they pass. Once the
+ * last slice of the frame is reported, the thread waits for the frame's turn and processes the
+ * recorded calls. The turn is passed on at the frame end, so frames are processed in decoding
+ * order, which FFmpeg reflects in the coded picture numbers. Processing the frame before the
+ * frame end keeps the reference pictures intact, the decoder marks them anew afterwards. */
+struct call_s {
+	/* the parts of the decoder context that change from one hook call to the next */
+	__typeof__(((AVCodecContext *)NULL)->metrics) metrics;
+	__typeof__(((AVCodecContext *)NULL)->frame) frame;
+	__typeof__(((AVCodecContext *)NULL)->slice) slice;
+	/* the slice reference lists as positions in the reference stacks, which keep pointing
+	 * to the same pictures until the frame end: negative for long term, zero for none */
+	int count[2];
+	int8_t stacked[2][REF_MAX];
+};
+
+struct recorder_s {
+	/* the thread context of the decoder */
+	const AVCodecContext *context;
+	/* the calls since the frame start */
+	struct call_s *call;
+	size_t count, capacity;
+	/* coded picture number of the recorded frame */
+	int frame;
+	/* the recorded calls have been processed, the turn is held until the frame end */
+	bool holding;
+};
+
+static struct recorder_s *find_recorder(const AVCodecContext *c)
+{
+	struct recorder_s *recorder = NULL;
 	
-	/* pass skipping hint to FFmpeg so it can drop the decoding of the upcoming slice */
-	c->slice.skip    = skip_slice;
-#ifdef SCHEDULE_EXECUTE
-	c->slice.conceal = proc.schedule.conceal;
-#endif
+	pthread_mutex_lock(&proc->threads.lock);
+	for (size_t i = 0; i < proc->threads.recorders; i++)
+		if (proc->threads.recorder[i]->context == c)
+			recorder = proc->threads.recorder[i];
+	if (!recorder) {
+		recorder = calloc(1, sizeof(struct recorder_s));
+		proc->threads.recorder = realloc(proc->threads.recorder, (proc->threads.recorders + 1) * sizeof(struct recorder_s *));
+		if (!recorder || !proc->threads.recorder) {
+			printf("could not allocate a frame thread recorder\n");
+			exit(1);
+		}
+		recorder->context = c;
+		proc->threads.recorder[proc->threads.recorders++] = recorder;
+	}
+	pthread_mutex_unlock(&proc->threads.lock);
 	
-	FFMPEG_TIME_START(c, total);
+	return recorder;
 }
 
+/* the decoder is closed, so its threads are gone, calls of unfinished frames are dropped */
+static void destroy_recorders(void)
+{
+	for (size_t i = 0; i < proc->threads.recorders; i++) {
+		av_free(proc->threads.recorder[i]->call);
+		free(proc->threads.recorder[i]);
+	}
+	free(proc->threads.recorder);
+	proc->threads.recorder = NULL;
+	proc->threads.recorders = 0;
+}
+
+/* waits until all frames up to the given one have been processed; this relies on the frame
+ * end being reported for every numbered picture, even if its decoding failed */
+static void take_turn(int frame)
+{
+	pthread_mutex_lock(&proc->threads.lock);
+	while (proc->threads.busy || frame > proc->threads.next)
+		pthread_cond_wait(&proc->threads.turn, &proc->threads.lock);
+	proc->threads.busy = true;
+	pthread_mutex_unlock(&proc->threads.lock);
+}
+
+static void pass_turn(int frame)
+{
+	pthread_mutex_lock(&proc->threads.lock);
+	proc->threads.busy = false;
+	if (frame >= proc->threads.next)
+		proc->threads.next = frame + 1;
+	pthread_cond_broadcast(&proc->threads.turn);
+	pthread_mutex_unlock(&proc->threads.lock);
+}
+
+/* position of the matching picture in the frame's reference stacks, numbered like the
+ * global reference numbers: -1 and below for long term, 1 and above for short term */
+static int8_t stacked_reference(const AVCodecContext *c, const AVFrame *frame)
+{
+	int i;
+	
+	for (i = 0; i < c->reference.long_count; i++)
+		if (c->reference.long_list[i]->coded_picture_number == frame->coded_picture_number)
+			return (int8_t)-(i + 1);
+	for (i = 0; i < c->reference.short_count; i++)
+		if (c->reference.short_list[i]->coded_picture_number == frame->coded_picture_number)
+			return (int8_t)(i + 1);
+	return 0;
+}
+
+static void record_call(struct recorder_s *recorder, const AVCodecContext *c)
+{
+	int list, i;
+	
+	if (recorder->count == recorder->capacity) {
+		recorder->capacity = 2 * recorder->capacity + 1;
+		recorder->call = av_realloc(recorder->call, recorder->capacity * sizeof(struct call_s));
+	}
+	struct call_s *call = &recorder->call[recorder->count++];
+	call->metrics = c->metrics;
+	call->frame = c->frame;
+	call->slice = c->slice;
+	/* the slice reference lists are decoder state the upcoming slice overwrites */
+	for (list = 0; list < 2; list++) {
+		call->count[list] = c->reference.count[list];
+		for (i = 0; i < REF_MAX && i < c->reference.count[list]; i++)
+			call->stacked[list][i] = stacked_reference(c, c->reference.list[list][i]);
+	}
+}
+
+/* processes the recorded calls with the thread's context, whose other state is unchanged
+ * since the frame start; the decoder's own reference lists are restored afterwards */
+static void replay_calls(AVCodecContext *c, const struct recorder_s *recorder)
+{
+	/* a picture missing from the stacks matches none of them */
+	static AVFrame unstacked = { .coded_picture_number = -1 };
+	AVFrame *list_saved[2][REF_MAX];
+	int count_saved[2], list, i;
+	
+	memcpy(list_saved, c->reference.list, sizeof(list_saved));
+	memcpy(count_saved, c->reference.count, sizeof(count_saved));
+	for (size_t k = 0; k < recorder->count; k++) {
+		const struct call_s *call = &recorder->call[k];
+		c->metrics = call->metrics;
+		c->frame = call->frame;
+		c->slice = call->slice;
+		for (list = 0; list < 2; list++) {
+			c->reference.count[list] = call->count[list];
+			for (i = 0; i < REF_MAX && i < call->count[list]; i++) {
+				const int stacked = call->stacked[list][i];
+				c->reference.list[list][i] = (stacked < 0) ? c->reference.long_list[-stacked - 1] :
+					((stacked > 0) ? c->reference.short_list[stacked - 1] : &unstacked);
+			}
+		}
+		handle_slice(c);
+	}
+	memcpy(c->reference.list, list_saved, sizeof(list_saved));
+	memcpy(c->reference.count, count_saved, sizeof(count_saved));
+}
+
+static void record_slice(AVCodecContext *c)
+{
+	struct recorder_s *recorder = find_recorder(c);
+	const int frame = c->frame.current ? c->frame.current->coded_picture_number : -1;
+	
+	switch (c->metrics.type) {
+		case PSEUDO_SLICE_FRAME_START:
+			/* reported with the last slice flag, this call means that no slice was decoded */
+			if (c->slice.flag_last) break;
+			if (recorder->count) {
+				/* the previous decoding of this thread failed before its last slice,
+				 * its pictures may be gone, so its calls are dropped, but not its turn */
+				take_turn(recorder->frame);
+				pass_turn(recorder->frame);
+				recorder->count = 0;
+			}
+			recorder->frame = frame;
+			record_call(recorder, c);
+			break;
+			
+		case PSEUDO_SLICE_FRAME_END:
+			if (!recorder->holding) {
+				/* nothing was processed, because nothing was decoded or the decoding failed
+				 * before the last slice, but the decoder may have numbered pictures anyway;
+				 * a failed decoding reports the picture it started, if any, as current */
+				const int numbered = (recorder->count && recorder->frame > frame) ? recorder->frame : frame;
+				recorder->count = 0;
+				take_turn(numbered);
+				pass_turn(numbered);
+				break;
+			}
+			handle_slice(c);
+			recorder->holding = false;
+			pass_turn(recorder->frame);
+			break;
+			
+		default:
+			/* regular slice */
+			if (!recorder->count) break;
+			record_call(recorder, c);
+			if (c->slice.flag_last) {
+				take_turn(recorder->frame);
+				replay_calls(c, recorder);
+				recorder->count = 0;
+				recorder->holding = true;
+			}
+	}
+}
+#endif
+
 #if METADATA_READ
+#if !METADATA_SIDECAR
 static void process_metadata(const uint8_t *nalu)
 {
-	nalu_read_start(proc.metadata.read, nalu);
-	uint_fast16_t mb_width  = nalu_read_unsigned(proc.metadata.read);
-	uint_fast16_t mb_height = nalu_read_unsigned(proc.metadata.read);
+	nalu_read_start(proc->metadata.read, nalu);
+	read_metadata();
+}
+#else
+static void process_sidecar(void)
+{
+	/* the decoder reports the end of the stream repeatedly, but every frame has one sidecar NALU */
+	if (!proc->metadata.sidecar_pending) return;
+	proc->metadata.sidecar_pending = false;
+	
+	const uint8_t *nalu = nalu_sidecar_next(proc->metadata.sidecar);
+	if (!nalu) {
+		printf("ERROR: metadata sidecar ends before the video\n");
+		exit(1);
+	}
+	nalu_read_start_escaped(proc->metadata.read, nalu);
+	read_metadata();
+}
+#endif
+
+static void read_metadata(void)
+{
+	const uint_fast32_t fields = nalu_read_fields(proc->metadata.read);
+	const uint_fast32_t float_fields = nalu_read_float_fields(proc->metadata.read);
+	uint_fast16_t mb_width  = nalu_read_unsigned(proc->metadata.read);
+	uint_fast16_t mb_height = nalu_read_unsigned(proc->metadata.read);
 	resize_storage(mb_width, mb_height);
-	proc.frame->slice_count = nalu_read_unsigned(proc.metadata.read);
-	for (size32_t i = 0; i < proc.frame->slice_count; i++)
-		read_metrics(proc.frame, i);
-	read_replacement_tree(NULL);
-	for (size32_t i = 0; i < proc.frame->slice_count; i++) {
-		proc.frame->slice[i].start_index = nalu_read_unsigned(proc.metadata.read);
+	const size32_t slice_count = nalu_read_unsigned(proc->metadata.read);
+	reserve_slices(proc->frame, slice_count);
+	proc->frame->slice_count = slice_count;
+	for (size32_t i = 0; i < proc->frame->slice_count; i++) {
+		read_metrics(proc->frame, i, fields);
+		/* skip values we do not know about, the unsigned ones come first */
+		for (uint_fast32_t field = metrics_fields; field < fields; field++)
+			nalu_read_unsigned(proc->metadata.read);
+		for (uint_fast32_t field = 0; field < float_fields; field++)
+			nalu_read_float(proc->metadata.read);
+	}
+	read_replacement_tree();
+	for (size32_t i = 0; i < proc->frame->slice_count; i++) {
+		proc->frame->slice[i].start_index = nalu_read_unsigned(proc->metadata.read);
 		if (i > 0)
-			proc.frame->slice[i-1].end_index = proc.frame->slice[i].start_index;
-		if (i == proc.frame->slice_count - 1)
-			proc.frame->slice[i].end_index = proc.mb_width * proc.mb_height;
-		if (proc.frame->replacement)
-			proc.frame->slice[i].direct_quality_loss = nalu_read_float(proc.metadata.read);
+			proc->frame->slice[i-1].end_index = proc->frame->slice[i].start_index;
+		if (i == proc->frame->slice_count - 1)
+			proc->frame->slice[i].end_index = proc->mb_width * proc->mb_height;
+		if (proc->frame->replacement)
+			proc->frame->slice[i].direct_quality_loss = nalu_read_float(proc->metadata.read);
 	}
-	for (size32_t i = 0; i < proc.frame->slice_count; i++)
-		proc.frame->slice[i].emission_factor = nalu_read_float(proc.metadata.read);
+	for (size32_t i = 0; i < proc->frame->slice_count; i++)
+		proc->frame->slice[i].emission_factor = nalu_read_float(proc->metadata.read);
 	
 #if METADATA_READ && !PREPROCESS && (SCHEDULING_METHOD == LIFETIME)
 	/* read immission factors for slice tracking from separate file */
-	read_immission(proc.frame);
+	read_immission(proc->frame);
 #endif
 	
 #if 0
 	/* FIXME: port various adaptation methods over to FFplay */
-	for (i = 0; i < proc.frame->slice_count; i++) {
+	for (i = 0; i < proc->frame->slice_count; i++) {
 		/* calculate the benefit value for each slice */
-		proc.frame->slice[i].decoding_time    = llsp_predict(proc.llsp.decode, metrics_decode(proc.frame, i));
-		proc.frame->slice[i].replacement_time = llsp_predict(proc.llsp.replace, metrics_replace(proc.frame, i));
-		if (!proc.frame->replacement || proc.frame->slice[i].decoding_time <= proc.frame->slice[i].replacement_time)
-			proc.frame->slice[i].benefit = HUGE_VAL;
+		proc->frame->slice[i].decoding_time    = llsp_predict(proc->llsp.decode, metrics_decode(proc->frame, i));
+		proc->frame->slice[i].replacement_time = llsp_predict(proc->llsp.replace, metrics_replace(proc->frame, i));
+		if (!proc->frame->replacement || proc->frame->slice[i].decoding_time <= proc->frame->slice[i].replacement_time)
+			proc->frame->slice[i].benefit = HUGE_VAL;
 		else
 #if SCHEDULING_METHOD == COST
-			proc.frame->slice[i].benefit = 1 / proc.frame->slice[i].decoding_time;
+			proc->frame->slice[i].benefit = 1 / proc->frame->slice[i].decoding_time;
 #elif SCHEDULING_METHOD == DIRECT_ERROR
-		proc.frame->slice[i].benefit = proc.frame->slice[i].direct_quality_loss;
+		proc->frame->slice[i].benefit = proc->frame->slice[i].direct_quality_loss;
 #elif SCHEDULING_METHOD == LIFETIME
-		proc.frame->slice[i].benefit =
-		(proc.frame->slice[i].direct_quality_loss * (1 + proc.frame->reference_lifetime)) /
-		(proc.frame->slice[i].decoding_time - proc.frame->slice[i].replacement_time);
+		proc->frame->slice[i].benefit =
+		(proc->frame->slice[i].direct_quality_loss * (1 + proc->frame->reference_lifetime)) /
+		(proc->frame->slice[i].decoding_time - proc->frame->slice[i].replacement_time);
 #else
-		proc.frame->slice[i].benefit =
-		(proc.frame->slice[i].direct_quality_loss * proc.frame->slice[i].emission_factor) /
-		(proc.frame->slice[i].decoding_time - proc.frame->slice[i].replacement_time);
+		proc->frame->slice[i].benefit =
+		(proc->frame->slice[i].direct_quality_loss * proc->frame->slice[i].emission_factor) /
+		(proc->frame->slice[i].decoding_time - proc->frame->slice[i].replacement_time);
 #endif
 		/* safety margin */
-		proc.frame->slice[i].decoding_time    *= safety_margin_decode;
-		proc.frame->slice[i].replacement_time *= safety_margin_replace;
+		proc->frame->slice[i].decoding_time    *= safety_margin_decode;
+		proc->frame->slice[i].replacement_time *= safety_margin_replace;
 	}
 #endif
 }
@@ -251,21 +779,36 @@ static void process_metadata(const uint8_t *nalu)
 #if METADATA_WRITE
 static void write_metadata(void)
 {
-	for (frame_node_t *frame = proc.last_idr; frame; frame = frame->next) {
+	/* the list starts with the IDR, all its frames refer to its index record */
+	const uint32_t idr = proc->metadata.index_frames;
+	
+#if FRAME_THREADS
+	pthread_mutex_lock(&proc->metadata.packets);
+#endif
+	for (frame_node_t *frame = proc->last_idr; frame; frame = frame->next) {
+		const uint64_t frame_offset = nalu_copy_position(proc->metadata.write);
+		const uint64_t slices = proc->metadata.index_slice_entries;
+		
 		/* copy slices worth a full frame */
 		for (size32_t i = 0; i < frame->slice_count; i++) {
 			// forward to the next slice start
-			while (!check_slice_start(proc.metadata.write))
-				copy_nalu(proc.metadata.write);
+			while (!check_slice_start(proc->metadata.write))
+				copy_nalu(proc->metadata.write);
 			// now copy the actual slice
-			copy_nalu(proc.metadata.write);
+			write_index_slice((uint32_t)(nalu_copy_position(proc->metadata.write) - frame_offset));
+			copy_nalu(proc->metadata.write);
 		}
 		
 		/* write our metadata as a custom NALU */
-		nalu_write_start(proc.metadata.write);
-		nalu_write_unsigned(proc.metadata.write, proc.mb_width);
-		nalu_write_unsigned(proc.metadata.write, proc.mb_height);
-		nalu_write_unsigned(proc.metadata.write, frame->slice_count);
+		const uint64_t metadata_offset = nalu_write_position(proc->metadata.write);
+#if METRICS_EXTRACT || METADATA_READ
+		nalu_write_start(proc->metadata.write, METADATA_VERSION, metrics_fields, 0);
+#else
+		nalu_write_start(proc->metadata.write, METADATA_VERSION, 0, 0);
+#endif
+		nalu_write_unsigned(proc->metadata.write, proc->mb_width);
+		nalu_write_unsigned(proc->metadata.write, proc->mb_height);
+		nalu_write_unsigned(proc->metadata.write, frame->slice_count);
 #if METRICS_EXTRACT || METADATA_READ
 		for (size32_t i = 0; i < frame->slice_count; i++)
 			write_metrics(frame, i);
@@ -273,51 +816,201 @@ static void write_metadata(void)
 #if PREPROCESS || METADATA_READ
 		write_replacement_tree(frame->replacement);
 		for (size32_t i = 0; i < frame->slice_count; i++) {
-			nalu_write_unsigned(proc.metadata.write, frame->slice[i].start_index);
+			nalu_write_unsigned(proc->metadata.write, frame->slice[i].start_index);
 			if (frame->replacement)
-				nalu_write_float(proc.metadata.write, frame->slice[i].direct_quality_loss);
+				nalu_write_float(proc->metadata.write, frame->slice[i].direct_quality_loss);
 		}
 #else
-		nalu_write_unsigned(proc.metadata.write, 0);  // empty replacement tree: depth
-		nalu_write_signed(proc.metadata.write, 0);    // empty replacement tree: reference
-		nalu_write_unsigned(proc.metadata.write, 0);  // first slice's start_index
+		nalu_write_unsigned(proc->metadata.write, 0);  // empty replacement tree: no presence flag
+		nalu_write_unsigned(proc->metadata.write, 0);  // first slice's start_index
 		for (size32_t i = 0; i < frame->slice_count - 1; i++)
-			nalu_write_unsigned(proc.metadata.write, proc.mb_width * proc.mb_height);
+			nalu_write_unsigned(proc->metadata.write, proc->mb_width * proc->mb_height);
 #endif
 		for (size32_t i = 0; i < frame->slice_count; i++)
 #if PREPROCESS || METADATA_READ
-			nalu_write_float(proc.metadata.write, frame->slice[i].emission_factor);
+			nalu_write_float(proc->metadata.write, frame->slice[i].emission_factor);
 #else
-			nalu_write_float(proc.metadata.write, 0.0);
+			nalu_write_float(proc->metadata.write, 0.0);
 #endif
-		nalu_write_end(proc.metadata.write);
+		nalu_write_end(proc->metadata.write);
 		
+		uint64_t propagation_offset = UINT64_MAX;
 #if METADATA_WRITE && PREPROCESS && !METADATA_READ
 		/* store immission factors in a separate file, so we can use them for slice tracking later */
+		if (proc->metadata.propagation)
+			propagation_offset = (uint64_t)ftello(proc->metadata.propagation);
 		write_immission(frame);
 #endif
+		write_index(idr, frame_offset, metadata_offset, propagation_offset, slices, frame->slice_count);
+	}
+	
+	/* the GOP is complete, let downstream consumers have it */
+	nalu_write_flush(proc->metadata.write);
+	if (proc->metadata.index) {
+		fflush(proc->metadata.index_slices);
+		fflush(proc->metadata.index);
 	}
+#if FRAME_THREADS
+	pthread_mutex_unlock(&proc->metadata.packets);
+#endif
+}
+
+static inline uint8_t *put_big_endian(uint8_t *buf, uint64_t value, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; i++)
+		buf[i] = (uint8_t)(value >> (8 * (bytes - 1 - i)));
+	return buf + bytes;
+}
+
+static inline uint64_t get_big_endian(const uint8_t *buf, size_t bytes)
+{
+	uint64_t value = 0;
+	for (size_t i = 0; i < bytes; i++)
+		value = (value << 8) | buf[i];
+	return value;
+}
+
+/* The index contains one record of INDEX_RECORD_SIZE bytes per frame in stream order, so the
+ * record of frame n is found at offset n * INDEX_RECORD_SIZE. All fields are big-endian:
+ * 8 bytes  video offset of the frame's first NALU, including parameter sets ahead of its slices;
+ *          with a sidecar, this is an offset into the untouched source video
+ * 8 bytes  output offset of the frame's metadata NALU, in the sidecar if there is one
+ * 8 bytes  offset of the frame's immission factors in the propagation file, all ones if there are none
+ * 8 bytes  number of the frame's first entry in the slice table
+ * 4 bytes  number of the record of the IDR starting the frame's GOP
+ * 4 bytes  slice count
+ * The slice table next to the index, with the _slices suffix, holds one 4 byte big-endian
+ * entry of INDEX_SLICE_SIZE per slice with the offset of the slice NALU relative to the
+ * frame's first NALU. The entries of a frame are consecutive, at offset entry * INDEX_SLICE_SIZE. */
+static void write_index(uint32_t idr, uint64_t frame, uint64_t metadata, uint64_t propagation,
+						uint64_t slices, size32_t slice_count)
+{
+	uint8_t record[INDEX_RECORD_SIZE];
+	uint8_t *buf = record;
+	
+	proc->metadata.index_frames++;
+	if (!proc->metadata.index) return;
+	
+	buf = put_big_endian(buf, frame, 8);
+	buf = put_big_endian(buf, metadata, 8);
+	buf = put_big_endian(buf, propagation, 8);
+	buf = put_big_endian(buf, slices, 8);
+	buf = put_big_endian(buf, idr, 4);
+	buf = put_big_endian(buf, slice_count, 4);
+	
+	fwrite(record, 1, INDEX_RECORD_SIZE, proc->metadata.index);
+}
+
+static void write_index_slice(uint32_t slice)
+{
+	uint8_t entry[INDEX_SLICE_SIZE];
+	
+	proc->metadata.index_slice_entries++;
+	if (!proc->metadata.index) return;
+	
+	put_big_endian(entry, slice, INDEX_SLICE_SIZE);
+	fwrite(entry, 1, INDEX_SLICE_SIZE, proc->metadata.index_slices);
+}
+
+/* moves a record and its slice entries written for a part of the stream to the position of the part within the whole */
+static void rebase_index(uint8_t *record, uint8_t *slice, uint32_t idr_base, uint64_t slices_base,
+						 uint64_t video_base, uint64_t video_skip,
+						 uint64_t output_base, uint64_t output_skip, uint64_t propagation_base)
+{
+	uint64_t frame = get_big_endian(&record[0], 8);
+	const uint64_t metadata = get_big_endian(&record[8], 8);
+	const uint64_t propagation = get_big_endian(&record[16], 8);
+	const uint32_t idr = (uint32_t)get_big_endian(&record[32], 4);
+	const size32_t slice_count = (size32_t)get_big_endian(&record[36], 4);
+	
+	/* the part's first frame starts with the bytes ahead of it, which are dropped in the merge */
+	if (frame < video_skip) {
+		for (size32_t i = 0; i < slice_count; i++) {
+			const uint64_t offset = get_big_endian(&slice[INDEX_SLICE_SIZE * i], INDEX_SLICE_SIZE);
+			put_big_endian(&slice[INDEX_SLICE_SIZE * i], offset - (video_skip - frame), INDEX_SLICE_SIZE);
+		}
+		frame = video_skip;
+	}
+	
+	put_big_endian(&record[0], video_base + (frame - video_skip), 8);
+	put_big_endian(&record[8], output_base + (metadata - output_skip), 8);
+	if (propagation != UINT64_MAX)
+		put_big_endian(&record[16], propagation_base + propagation, 8);
+	put_big_endian(&record[24], slices_base, 8);
+	put_big_endian(&record[32], idr_base + idr, 4);
+}
+
+static uint64_t append_file(FILE *to, FILE *from)
+{
+	uint8_t buf[1 << 16];
+	uint64_t total = 0;
+	size_t size;
+	
+	while ((size = fread(buf, 1, sizeof(buf), from)) > 0) {
+		fwrite(buf, 1, size, to);
+		total += size;
+	}
+	return total;
+}
+
+static char *metadata_file(const char *file, const char *suffix)
+{
+	char *name = malloc(strlen(file) + strlen(suffix) + 1);
+	sprintf(name, "%s%s", file, suffix);
+	return name;
+}
+#endif
+
+#if (METADATA_WRITE && PREPROCESS) || (METADATA_READ && !PREPROCESS && (SCHEDULING_METHOD == LIFETIME))
+/* the immission factors are stored next to the video with the .prop ending */
+static char *propagation_file(const char *file)
+{
+	const size_t length = strlen(file);
+	char *propfile = NULL;
+	
+	if (strcmp(file, "-") == 0) {
+		/* streams have no name to derive the propagation file from, it is optional then */
+		const char *const envvar = getenv("PROPAGATION");
+		if (envvar)
+			propfile = strdup(envvar);
+	} else if (length >= sizeof("p264") - 1 && strcmp(&file[length - sizeof("264") + 1], "264") == 0) {
+		propfile = strdup(file);
+		propfile[length - sizeof("p264") + 1] = 'p';
+		propfile[length - sizeof("p264") + 2] = 'r';
+		propfile[length - sizeof("p264") + 3] = 'o';
+		propfile[length - sizeof("p264") + 4] = 'p';
+	} else {
+		printf("filename does not have the proper .?264 ending\n");
+		exit(1);
+	}
+	return propfile;
 }
 #endif
 
 static void resize_storage(size32_t mb_width, size32_t mb_height)
 {
-	if (mb_width != proc.mb_width || mb_height != proc.mb_height) {
+	if (mb_width != proc->mb_width || mb_height != proc->mb_height) {
 #if PREPROCESS
-		avpicture_free(&proc.temp_frame);
-		avpicture_alloc(&proc.temp_frame, PIX_FMT_YUV420P, mb_width << mb_size_log, mb_height << mb_size_log);
-		av_free(proc.ref_num[0]);
-		av_free(proc.ref_num[1]);
-		proc.ref_num[0] = (int8_t *)av_malloc((2*mb_width+1) * 2*mb_height * sizeof(int8_t));
-		proc.ref_num[1] = (int8_t *)av_malloc((2*mb_width+1) * 2*mb_height * sizeof(int8_t));
+		avpicture_free(&proc->temp_frame);
+		avpicture_alloc(&proc->temp_frame, PIX_FMT_YUV420P, mb_width << mb_size_log, mb_height << mb_size_log);
+		av_free(proc->ref_num[0]);
+		av_free(proc->ref_num[1]);
+		proc->ref_num[0] = (int8_t *)av_malloc((2*mb_width+1) * 2*mb_height * sizeof(int8_t));
+		proc->ref_num[1] = (int8_t *)av_malloc((2*mb_width+1) * 2*mb_height * sizeof(int8_t));
+		av_free(proc->patches);
+		av_free(proc->variant_patches);
+		proc->patches = (ssim_patch_t *)av_malloc(mb_width * mb_height * sizeof(ssim_patch_t));
+		proc->variant_patches = (ssim_patch_t *)av_malloc(mb_width * mb_height * sizeof(ssim_patch_t));
+		av_free(proc->slice_map);
+		proc->slice_map = (uint16_t *)av_malloc(mb_width * mb_height * sizeof(uint16_t));
 #endif
 #ifdef SCHEDULE_EXECUTE
-		avpicture_free(&proc.propagation.vis_frame);
-		avpicture_alloc(&proc.propagation.vis_frame, PIX_FMT_YUV420P,
+		avpicture_free(&proc->propagation.vis_frame);
+		avpicture_alloc(&proc->propagation.vis_frame, PIX_FMT_YUV420P,
 						mb_width << (mb_size_log + 1), mb_height << (mb_size_log + 1));
 #endif
-		proc.mb_width  = mb_width;
-		proc.mb_height = mb_height;
+		proc->mb_width  = mb_width;
+		proc->mb_height = mb_height;
 	}
 }
 
@@ -325,75 +1018,111 @@ static void setup_frame(const AVCodecContext *c)
 {
 	frame_node_t *frame;
 	
-	/* allocate new frame node */
-	frame = (frame_node_t *)av_malloc(sizeof(frame_node_t));
-	if (!proc.last_idr)
-		proc.last_idr = frame;
-	if (proc.frame)
-		proc.frame->next = frame;
-	proc.frame = frame;
+	/* allocate new frame node, a new frame list starts new GOP storage */
+	if (!proc->gop)
+		proc->gop = arena_alloc();
+	frame = (frame_node_t *)arena_push(proc->gop, sizeof(frame_node_t));
+	if (!proc->last_idr)
+		proc->last_idr = frame;
+	if (proc->frame)
+		proc->frame->next = frame;
+	proc->frame = frame;
 	/* initialize */
-	proc.frame->next = NULL;
-	
-#if PREPROCESS && METADATA_READ
-	/* lookahead already created a replacement tree, which we want to re-create from scratch */
-	destroy_replacement_tree(proc.frame->replacement);
+	proc->frame->next = NULL;
+#if PREPROCESS || (SCHEDULING_METHOD == LIFETIME)
+	proc->frame->immission = NULL;
+	proc->frame->immission_count = 0;
 #endif
+	
+	/* slice storage starts out as large as the previous frame needed */
+	proc->frame->slice = NULL;
+	proc->frame->slice_capacity = 0;
+	reserve_slices(proc->frame, proc->slice_hint ? proc->slice_hint : 1);
+	
 #if PREPROCESS || SLICE_SKIP
-	/* SLICE_MAX is a "virtual" slice that covers the entire frame;
+	/* SLICE_FRAME is a "virtual" slice that covers the entire frame;
 	 * this allows handling a full frame with one do_replacement() call;
 	 * quite a hack, I know... */
-	proc.frame->slice[SLICE_MAX].start_index = 0;
-	proc.frame->slice[SLICE_MAX].end_index = proc.mb_width * proc.mb_height;
+	proc->frame->slice[SLICE_FRAME].start_index = 0;
+	proc->frame->slice[SLICE_FRAME].end_index = proc->mb_width * proc->mb_height;
 #endif
 #if PREPROCESS
-	proc.frame->slice[SLICE_MAX].rect.min_x = 0;
-	proc.frame->slice[SLICE_MAX].rect.min_y = 0;
-	proc.frame->slice[SLICE_MAX].rect.max_x = c->width;
-	proc.frame->slice[SLICE_MAX].rect.max_y = c->height;
-	proc.frame->replacement = NULL;
-	
-	for (size32_t slice = 0; slice < SLICE_MAX + 1; slice++) {
-		memset(proc.frame->slice[slice].immission_base, 0, sizeof(proc.frame->slice[0].immission_base));
-		proc.frame->slice[slice].immission = proc.frame->slice[slice].immission_base + REF_MAX;
-	}
-	proc.frame->reference = proc.frame->reference_base + REF_MAX;
+	proc->frame->slice[SLICE_FRAME].rect.min_x = 0;
+	proc->frame->slice[SLICE_FRAME].rect.min_y = 0;
+	proc->frame->slice[SLICE_FRAME].rect.max_x = c->width;
+	proc->frame->slice[SLICE_FRAME].rect.max_y = c->height;
+	proc->frame->replacement = NULL;
+	
+	/* the reference stack is copied with the frame's first slice */
+	proc->frame->reference = NULL;
+	proc->frame->reference_min = proc->frame->reference_max = 0;
 	
 	/* attach the frame node to the frame so it travels nicely through FFmpeg,
 	 * opaque needs to be a double-pointer, because we are modifying a copy of the actual
 	 * AVFrame here; so modifying a direct pointer would have no effect on the original */
-	*(frame_node_t **)c->frame.current->opaque = proc.frame;
-	/* the frame must be unused by both FFmpeg and ourselves */
-	proc.frame->reference_count = 2;
+	*(frame_node_t **)c->frame.current->opaque = proc->frame;
+	/* the frame must be unused by both FFmpeg and ourselves, until then it keeps its GOP storage */
+	proc->frame->reference_count = 2;
+	proc->frame->arena = proc->gop;
+	arena_retain(proc->gop);
 #else
 	(void)c;
 #endif
 #if !METADATA_READ || METRICS_EXTRACT || PREPROCESS
-	proc.frame->slice_count = 0;
+	proc->frame->slice_count = 0;
 #endif
 }
 
+static void reserve_slices(frame_node_t *frame, size32_t count)
+{
+	if (count <= frame->slice_capacity) return;
+	if (count > SLICE_LIMIT) {
+		printf("ERROR: maximum number of slices exceeded\n");
+		exit(1);
+	}
+	
+	size32_t capacity = 2 * frame->slice_capacity;
+	if (capacity < count) capacity = count;
+	if (capacity > SLICE_LIMIT) capacity = SLICE_LIMIT;
+	
+	/* the storage grows within the GOP, the pseudo-slice is the entry in front */
+	void *storage = arena_push(proc->gop, (capacity + 1) * sizeof(frame->slice[0]));
+	if (frame->slice)
+		memcpy(storage, &frame->slice[SLICE_FRAME], (frame->slice_capacity + 1) * sizeof(frame->slice[0]));
+	frame->slice = storage;
+	frame->slice -= SLICE_FRAME;
+	frame->slice_capacity = capacity;
+}
+
 static void destroy_frames_list(void)
 {
-	frame_node_t *frame, *prev;
+	frame_node_t *frame, *next;
 	
-	for (frame = proc.last_idr, prev = NULL; frame; prev = frame, frame = frame->next) {
+	for (frame = proc->last_idr; frame; frame = next) {
+		next = frame->next;
 #if PREPROCESS || METADATA_READ
-		destroy_replacement_tree(frame->replacement);
+		/* replacement trees live in the GOP storage */
 		frame->replacement = NULL;
 #endif
-		if (prev
 #if PREPROCESS
-			&& !--prev->reference_count
+		if (!__sync_sub_and_fetch(&frame->reference_count, 1))
 #endif
-			)
-			av_free(prev);
+			destroy_frame(frame);
 	}
-	proc.last_idr = proc.frame = NULL;
-	if (prev
+	proc->last_idr = proc->frame = NULL;
+	/* the GOP storage is freed as a whole once FFmpeg is done with the frames as well */
+	arena_release(proc->gop);
+	proc->gop = NULL;
+}
+
+static void destroy_frame(frame_node_t *frame)
+{
+#if PREPROCESS || (SCHEDULING_METHOD == LIFETIME)
+	av_free(frame->immission);
+#endif
 #if PREPROCESS
-		&& !--prev->reference_count
+	arena_release(frame->arena);
+#else
+	(void)frame;
 #endif
-		)
-		av_free(prev);
 }
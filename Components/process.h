@@ -10,6 +10,8 @@
 #pragma clang diagnostic ignored "-Wpadded"
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 #include "config.h"
 #include "libavcodec/avcodec.h"
@@ -52,6 +54,13 @@
 #  define METADATA_READ        0
 #endif
 
+/* toggle keeping metadata in a sidecar file next to the untouched H.264 file */
+#ifdef METADATA_SIDECAR
+#  define METADATA_SIDECAR     1
+#else
+#  define METADATA_SIDECAR     0
+#endif
+
 /* toggle slice skipping and replacement based on some scheduling */
 #ifdef SLICE_SKIP
 #  define SLICE_SKIP           1
@@ -59,6 +68,20 @@
 #  define SLICE_SKIP           0
 #endif
 
+/* toggle estimation of large replacement areas on reduced resolution during preprocessing */
+#ifdef PYRAMID_SSIM
+#  define PYRAMID_SSIM         1
+#else
+#  define PYRAMID_SSIM         0
+#endif
+
+/* toggle checking of all reduced resolution decisions against full resolution */
+#ifdef PYRAMID_REPORT
+#  define PYRAMID_REPORT       1
+#else
+#  define PYRAMID_REPORT       0
+#endif
+
 /* configuration presets */
 #if defined(FINAL_SCHEDULING) || \
 defined(SCHEDULE_EXECUTE)
@@ -93,18 +116,47 @@ defined(SCHEDULE_EXECUTE)
 #if METADATA_WRITE && !METRICS_EXTRACT
 #  warning  extracted metadata will be invalid
 #endif
+#if METADATA_SIDECAR && !METADATA_READ && !METADATA_WRITE
+#  warning  there is no metadata to keep in a sidecar
+#endif
+#if METADATA_SIDECAR && METADATA_READ && METADATA_WRITE
+#  error  the sidecar being read would be overwritten
+#endif
 #if SLICE_SKIP && !METADATA_READ
 #  warning  slice skipping only works properly with metadata available
 #endif
 #if SLICE_SKIP && (METRICS_EXTRACT || PREPROCESS)
 #  warning  slices will not be skipped for real as this would scramble the extracted metadata
 #endif
+#if (PYRAMID_SSIM || PYRAMID_REPORT) && !PREPROCESS
+#  warning  reduced resolution estimates are only used for preprocessing
+#endif
+#if PYRAMID_REPORT && !PYRAMID_SSIM
+#  warning  there are no reduced resolution decisions to report on
+#endif
 
-/* maximum supported number of slices per frame, must be less than 256 */
-#define SLICE_MAX 32
-/* maximum supported number of references per frame, must be less than 128 */
+/* Frame-threaded decoding defers the processing of a frame until the frame is decoded. This is
+ * the only kind of threading supported; these cases still decode with a single thread:
+ * - FFmpeg's slice threading, because the patched decoder keeps the per-slice hook state in
+ *   the shared decoder context and reports a slice only when the next one starts
+ * - slice skipping, whose decisions feed back into the decoder before the next slice
+ * - decoding time measurement, which times the decoder running alone
+ * - embedded metadata, whose NALUs have to be read while the decoder passes them */
+#if SLICE_SKIP || FFMPEG_TIME || (METADATA_READ && !METADATA_SIDECAR)
+#  define FRAME_THREADS        0
+#else
+#  define FRAME_THREADS        1
+#endif
+
+/* slice numbers are stored in 16 bits, per-frame slice storage is sized from the actual slice count */
+#define SLICE_LIMIT 65535
+/* pseudo-slice number of the whole frame */
+#define SLICE_FRAME (-1)
+/* length of FFmpeg's reference lists, only scratch storage is sized by it, must be less than 128 */
 #define REF_MAX 32
 
+#include "arena.h"
+
 #if METADATA_READ || METADATA_WRITE
 #  include "nalu.h"
 #endif
@@ -137,9 +189,16 @@ extern void hook_frame_end(const AVCodecContext *c) WEAK_SYMBOL;
 
 typedef struct replacement_node_s replacement_node_t;
 typedef struct frame_node_s frame_node_t;
-typedef float propagation_t[SLICE_MAX];
 typedef uint_fast32_t size32_t;
 
+/* factor by which errors from a slice of a reference frame propagate, only nonzero ones are stored */
+typedef struct {
+	float factor;
+	/* reference number and the slice in that reference */
+	int8_t reference;
+	uint16_t slice;
+} immission_t;
+
 /* node in the quadtree describing frame replacement */
 struct replacement_node_s {
 	/* position of this node in the tree */
@@ -157,12 +216,15 @@ struct replacement_node_s {
 /* storage for per-frame data */
 struct frame_node_s {
 #if PREPROCESS
-	/* avoids premature deletion */
+	/* avoids premature deletion, FFmpeg may drop its reference on another thread */
 	int reference_count;
+	/* the GOP storage holding this node, kept alive until the node is no longer used */
+	arena_t *arena;
 #endif
 	
-	size32_t slice_count;
-	/* storage for per-slice data, slice[SLICE_MAX] is a pseudo-slice covering the whole frame */
+	/* number of slices and of the slices there is storage for */
+	size32_t slice_count, slice_capacity;
+	/* storage for per-slice data, slice[SLICE_FRAME] is a pseudo-slice covering the whole frame */
 	struct {
 		/* decoding time metrics */
 #if METRICS_EXTRACT || METADATA_READ
@@ -187,30 +249,30 @@ struct frame_node_s {
 		float emission_factor;
 #endif
 #if PREPROCESS || (SCHEDULING_METHOD == LIFETIME)
-		/* how much do errors from reference slices propagate into this slice */
-		propagation_t immission_base[2 * REF_MAX + 1];
-		/* propagation will point to propagation_base[REF_MAX], so it can be indexed
-		 * from -REF_MAX to REF_MAX, which is the values range of reference numbers */
-		propagation_t *immission;
+		/* how much do errors from reference slices propagate into this slice,
+		 * the factors from immission_start (inclusive) to immission_end (exclusive) */
+		size32_t immission_start, immission_end;
 #endif
 #if defined(FINAL_SCHEDULING)
 		/* is this slice to be skipped */
 		int skip;
 #endif
-	} slice[SLICE_MAX + 1];
+	} *slice;
 	
 #if PREPROCESS || METADATA_READ
 	/* the root of the replacement quadtree, NULL if no replacement is possible */
 	replacement_node_t *replacement;
 #endif
 #if PREPROCESS
-	/* a copy of the reference stack for this frame */
-	frame_node_t *reference_base[2 * REF_MAX + 1];
-	/* reference will point to reference_base[REF_MAX], so it can be indexed
-	 * from -REF_MAX to REF_MAX, which is the values range of reference numbers */
+	/* a copy of the reference stack for this frame, which can be indexed from reference_min to
+	 * reference_max: negative numbers are long term references and positive ones short term */
 	frame_node_t **reference;
+	int reference_min, reference_max;
 #endif
 #if PREPROCESS || (SCHEDULING_METHOD == LIFETIME)
+	/* immission factors of all slices, ordered by slice, reference number and reference slice */
+	immission_t *immission;
+	size32_t immission_count;
 	/* how many future frames will see this frame in the reference stacks */
 	int reference_lifetime;
 #endif
@@ -218,7 +280,8 @@ struct frame_node_s {
 	frame_node_t *next;
 };
 
-extern struct proc_s {
+/* all processing state of one decoder, see process_init() */
+struct proc_s {
 	/* frames nodes are always kept from one IDR frame to the next, because
 	 * some processing like backwards-accumulation of error propagation can only
 	 * be performed at IDR frames; the layout of the frames list is:
@@ -234,6 +297,25 @@ extern struct proc_s {
 	frame_node_t *last_idr;
 	/* current frame */
 	frame_node_t *frame;
+	/* storage for the frame nodes and replacement trees of the frame list,
+	 * replacement trees are not freed individually, but with the GOP */
+	arena_t *gop;
+	/* slice count of the previous frame, which the slice storage of a new frame starts out with */
+	size32_t slice_hint;
+	
+#if FRAME_THREADS
+	/* frame threads record their hook calls and take turns processing them in decoding order */
+	struct {
+		pthread_mutex_t lock;
+		pthread_cond_t turn;
+		/* coded picture number of the next frame to be processed and whether one is in progress */
+		int next;
+		bool busy;
+		/* one recorder per thread context of the decoder */
+		struct recorder_s **recorder;
+		size_t recorders;
+	} threads;
+#endif
 	
 #if METADATA_READ || METADATA_WRITE
 	/* state variables for metadata reading/writing */
@@ -241,25 +323,62 @@ extern struct proc_s {
 #if METADATA_READ
 		nalu_read_t *read;
 #endif
+#if METADATA_READ && METADATA_SIDECAR
+		/* the metadata of the current frame is read from the sidecar once the frame is complete */
+		nalu_sidecar_t *sidecar;
+		bool sidecar_pending;
+#endif
 #if METADATA_WRITE
 		nalu_write_t *write;
+#if FRAME_THREADS
+		/* packets are queued while frame threads copy earlier ones */
+		pthread_mutex_t packets;
+#endif
+		/* random access index with one record per frame and the number of records written,
+		 * the slice table lists the slice offsets of all frames and its number of entries */
+		FILE *index;
+		uint32_t index_frames;
+		FILE *index_slices;
+		uint64_t index_slice_entries;
 #endif
 #if (METADATA_WRITE && PREPROCESS) || (METADATA_READ && !PREPROCESS && (SCHEDULING_METHOD == LIFETIME))
 		/* the immission factors do not belong to the metadata, but some of our
 		 * visualizations and measurements need them, so store them in an extra file */
 		FILE *propagation;
+#endif
+#if METADATA_READ && !PREPROCESS && (SCHEDULING_METHOD == LIFETIME)
+		unsigned propagation_version;
 #endif
 	} metadata;
 #endif
 	
+#if METADATA_READ
+	/* depth of the next leaf when reading a replacement tree of version 2 or lower */
+	int replacement_depth;
+#endif
+
 #ifdef SCHEDULE_EXECUTE
 	/* just some helpers for error propagation visualization */
 	struct {
 		AVPicture vis_frame;
 		double total_error;
+		FILE *original, *vis;
 	} propagation;
 #endif
 	
+#if SLICE_SKIP
+	struct {
+		/* number of the upcoming slice and the macroblocks to skip there */
+		int slice;
+		int skip;
+	} skip;
+#endif
+#ifdef FINAL_SCHEDULING
+	struct {
+		double frame_duration;
+		double frame_deadline;
+	} schedule;
+#endif
 #ifdef SCHEDULE_EXECUTE
 	struct {
 		int conceal;
@@ -268,18 +387,68 @@ extern struct proc_s {
 #endif
 	/* current video size */
 	size32_t mb_width, mb_height;
+#if PREPROCESS || defined(SCHEDULE_EXECUTE)
+	/* the sample positions of each SSIM calculation derive from the seed and the number of
+	 * calculations before, so they depend neither on other decoders nor on global state */
+	struct {
+		uint64_t seed, count;
+	} sampling;
+#endif
 #if PREPROCESS
 	/* intermediary frame storage */
 	AVPicture temp_frame;
+	/* storage for the fully subdivided quadtree while searching replacements */
+	arena_t *search;
+#if PYRAMID_SSIM
+	/* reduced resolution copies of the current frame and temp_frame */
+	ssim_pyramid_t *ssim_pyramid;
+#endif
+	/* replacement of each macroblock for the current quadtree and for the variant being evaluated */
+	ssim_patch_t *patches, *variant_patches;
+	/* reference frames of the current frame, indexed by reference number plus REF_MAX */
+	picture_t reference_picture[2 * REF_MAX + 1];
+	/* slice number of each macroblock of the current frame */
+	uint16_t *slice_map;
 	/* translated reference numbers (slice-local to global) of the current frame */
 	int8_t *ref_num[2];
+	/* immission factors of the current slice while its dependencies are collected,
+	 * one row per reference number with one factor per slice of the reference */
+	float *immission;
+	size_t immission_size;
+#endif
+#if PREPROCESS && PYRAMID_REPORT
+	struct {
+		/* subdivision decisions based on reduced resolution, refined at full resolution,
+		 * and unrefined ones turning out different at full resolution */
+		unsigned estimated, refined, differing;
+	} pyramid;
+#endif
+};
+
+/* The context of the decoder currently calling into the workbench. It is
+ * owned by the AVCodecContext's opaque pointer and bound to the calling thread
+ * whenever FFmpeg or the player enter the workbench, so independent decoders
+ * can run concurrently on separate threads. */
+extern __thread struct proc_s *proc;
+
+#if PREPROCESS || defined(SCHEDULE_EXECUTE)
+/* seed for the next SSIM calculation of the current decoder */
+static inline uint64_t sampling_seed(void)
+{
+	return proc->sampling.seed + proc->sampling.count++;
+}
 #endif
-} proc;
 
 static const int mb_size_log = 4;	/* log2 of the edge length of a macroblock */
 static const float ssim_precision = 0.05f;
 static const float subdivision_threshold = 0.01f;
+#if PYRAMID_SSIM
+static const unsigned pyramid_levels = 2;	/* number of 2x reductions used for the largest areas */
+static const unsigned pyramid_max_depth = 2;	/* deepest quadtree level estimated on reduced resolution */
+static const float pyramid_margin = 0.5f;	/* estimates closer to the threshold than this fraction are refined */
+#endif
 static const int output_queue = 10;     /* length of simulated player's frame queue */
+static const unsigned metrics_fields = 13;	/* values per slice stored by write_metrics() */
 #if SLICE_SKIP
 static const float safety_margin_decode  = 1.1f;
 static const float safety_margin_replace = 1.2f;
@@ -295,8 +464,20 @@ static const float safety_margin_replace = 1.0f;
 
 /* this is where it all begins */
 void process_init(AVCodecContext *c, const char *file);
+void process_packet(AVCodecContext *c, const AVPacket *packet);
 void process_finish(AVCodecContext *c);
 
+/* a range of the source stream, processed on its own under a separate file name */
+typedef struct {
+	char *file;
+	/* source offset of the range and the number of bytes ahead of it that do not belong to it */
+	uint64_t start, skip;
+} process_part_t;
+/* whether the outputs of independently processed parts can be merged */
+bool process_mergeable(void);
+/* concatenates the outputs of consecutive parts into the output for file and removes them */
+void process_merge(const char *file, const process_part_t *part, size_t count);
+
 #pragma mark -
 
 
@@ -310,7 +491,8 @@ void remember_metrics(const AVCodecContext *c);
 void write_metrics(const frame_node_t *frame, size32_t slice);
 #endif
 #if METADATA_READ
-void read_metrics(frame_node_t *frame, size32_t slice);
+/* reads the first of the given number of stored values, metrics beyond them are zero */
+void read_metrics(frame_node_t *frame, size32_t slice, uint_fast32_t fields);
 #endif
 
 #pragma mark -
@@ -333,9 +515,6 @@ int schedule_skip(const AVCodecContext *c, int current_slice);
 #if PREPROCESS
 void search_replacements(const AVCodecContext *c, replacement_node_t *node);
 #endif
-#if PREPROCESS || METADATA_READ
-void destroy_replacement_tree(replacement_node_t *node);
-#endif
 #if PREPROCESS
 void remember_slice_boundaries(const AVCodecContext *c);
 void remember_reference_frames(const AVCodecContext *c);
@@ -347,7 +526,7 @@ float do_replacement(const AVCodecContext *c, const AVPicture *frame, int slice,
 void write_replacement_tree(const replacement_node_t *node);
 #endif
 #if METADATA_READ
-void read_replacement_tree(replacement_node_t *node);
+void read_replacement_tree(void);
 #endif
 
 #pragma mark -
@@ -363,10 +542,19 @@ void accumulate_quality_loss(frame_node_t *frame);
 #ifdef SCHEDULE_EXECUTE
 void propagation_visualize(const AVCodecContext *c);
 #endif
+/* the propagation file starts with the magic "prop" and a version byte; version 2 widened
+ * the reference slice to two bytes, files without header are version 1 with one byte */
+#define PROPAGATION_HEADER_SIZE 5
+#define PROPAGATION_VERSION 2
+#if METADATA_WRITE && PREPROCESS
+void write_immission_header(FILE *file);
+#endif
 #if METADATA_WRITE && PREPROCESS && !METADATA_READ
 void write_immission(const frame_node_t *frame);
 #endif
 #if METADATA_READ && !PREPROCESS && (SCHEDULING_METHOD == LIFETIME)
+/* returns the version of the propagation file, zero if it is not supported */
+unsigned read_immission_header(FILE *file);
 void read_immission(frame_node_t *frame);
 #endif
 
@@ -3,6 +3,8 @@
  * economic rights: Technische Universitaet Dresden (Germany)
  */
 
+#include <math.h>
+
 #include "process.h"
 #include "libavcodec/mpegvideo.h"
 
@@ -12,41 +14,46 @@ static int fill_coordinates(replacement_node_t *node);
 
 #if PREPROCESS || SLICE_SKIP
 static inline const replacement_node_t *get_replacement_node(const replacement_node_t *node, const unsigned mb_x, const unsigned mb_y);
+static inline const AVFrame *get_replacement_frame(const AVCodecContext *c, const replacement_node_t *node);
 #endif
 
 #if PREPROCESS
 
 static int search_average_motion(const AVCodecContext *c, replacement_node_t *node);
-static void cut_nodes(const AVCodecContext *c, replacement_node_t *node,
-					  const picture_t *original, const picture_t *replaced);
+static void cut_nodes(const AVCodecContext *c, replacement_node_t *node);
+static void keep_replacement_node(replacement_node_t *target, const replacement_node_t *source);
+static picture_t picture(const AVCodecContext *c, const AVPicture *frame);
+static void set_patch(ssim_patch_t *patch, const replacement_node_t *node, int mb_x, int mb_y);
+static void copy_patches(ssim_patch_t *target, const ssim_patch_t *source, const replacement_node_t *node);
 
 void search_replacements(const AVCodecContext *c, replacement_node_t *node)
 {
-	int i;
+	int i, mb;
 	
 	if (!node) {
-		/* this is the root node, which is empty on initial call; we need to set it up */
-		node = proc.frame->replacement = (replacement_node_t *)av_malloc(sizeof(replacement_node_t));
+		/* this is the root node, which is empty on initial call; we need to set it up,
+		 * the search storage of the previous frame is no longer needed */
+		arena_reset(proc->search);
+		node = proc->frame->replacement = (replacement_node_t *)arena_push(proc->search, sizeof(replacement_node_t));
 		node->depth = 0;
 		node->index = 0;
 		node->node[0] = node->node[1] = node->node[2] = node->node[3] = NULL;
 		if (!fill_coordinates(node) || !search_average_motion(c, node)) {
-			av_free(node);
-			proc.frame->replacement = NULL;
+			proc->frame->replacement = NULL;
 			return;
 		}
 	}
 	
 	/* now we subdivide the current area into four sub-areas */
+	replacement_node_t *const subnode = (replacement_node_t *)arena_push(proc->search, 4 * sizeof(replacement_node_t));
 	for (i = 0; i < 4; i++) {
-		node->node[i] = (replacement_node_t *)av_malloc(sizeof(replacement_node_t));
+		node->node[i] = &subnode[i];
 		node->node[i]->depth = node->depth + 1;
 		node->node[i]->index = 4 * node->index + i;
 		node->node[i]->node[0] = node->node[i]->node[1] = node->node[i]->node[2] = node->node[i]->node[3] = NULL;
 		if (!fill_coordinates(node->node[i]) || !search_average_motion(c, node->node[i])) {
 			/* subdivision is not possible, revert and bail out */
-			for (; i >= 0; i--)
-				av_freep(&node->node[i]);
+			memset(node->node, 0, sizeof(node->node));
 			break;
 		}
 	}
@@ -58,38 +65,56 @@ void search_replacements(const AVCodecContext *c, replacement_node_t *node)
 	}
 	
 	if (node->depth == 0) {
-		picture_t original, replaced;
+		const picture_t original = picture(c, (const AVPicture *)c->frame.current);
+		const picture_t replaced = picture(c, &proc->temp_frame);
+		unsigned mb_x, mb_y;
 		
-		original.Y  = c->frame.current->data[0];
-		original.Cb = c->frame.current->data[1];
-		original.Cr = c->frame.current->data[2];
-		original.line_stride_Y  = c->frame.current->linesize[0];
-		original.line_stride_Cb = c->frame.current->linesize[1];
-		original.line_stride_Cr = c->frame.current->linesize[2];
-		original.width  = c->width;
-		original.height = c->height;
-		
-		replaced.Y  = proc.temp_frame.data[0];
-		replaced.Cb = proc.temp_frame.data[1];
-		replaced.Cr = proc.temp_frame.data[2];
-		replaced.line_stride_Y  = proc.temp_frame.linesize[0];
-		replaced.line_stride_Cb = proc.temp_frame.linesize[1];
-		replaced.line_stride_Cr = proc.temp_frame.linesize[2];
-		replaced.width  = c->width;
-		replaced.height = c->height;
+		/* the reference frames replacement patches are read from */
+		memset(proc->reference_picture, 0, sizeof(proc->reference_picture));
+		for (i = 0; i < REF_MAX; i++) {
+			if (i < c->reference.long_count)
+				proc->reference_picture[REF_MAX - (i + 1)] = picture(c, (const AVPicture *)c->reference.long_list[i]);
+			if (i < c->reference.short_count)
+				proc->reference_picture[REF_MAX + (i + 1)] = picture(c, (const AVPicture *)c->reference.short_list[i]);
+		}
+		for (mb_y = 0; mb_y < proc->mb_height; mb_y++)
+			for (mb_x = 0; mb_x < proc->mb_width; mb_x++)
+				set_patch(&proc->patches[mb_x + mb_y * proc->mb_width], get_replacement_node(node, mb_x, mb_y), mb_x, mb_y);
+		memcpy(proc->variant_patches, proc->patches, proc->mb_width * proc->mb_height * sizeof(ssim_patch_t));
 		
 		/* the quadtree is now fully subdivided, let's cut off some of the nodes bottom-up */
-		do_replacement(c, &proc.temp_frame, SLICE_MAX, NULL);
-		cut_nodes(c, node, &original, &replaced);
+#if PYRAMID_SSIM
+		/* the reduced copies follow all changes to temp_frame during the cut pass */
+		ssim_pyramid_reset(proc->ssim_pyramid, &original, &replaced, ssim_precision, sampling_seed());
+		do_replacement(c, &proc->temp_frame, SLICE_FRAME, NULL);
+#endif
+		cut_nodes(c, node);
+		/* the cut pass compares patchworks, only now the final replacement is materialized */
+		do_replacement(c, &proc->temp_frame, SLICE_FRAME, NULL);
 		
-		/* calculate the error for each slice individually */
-		for (i = 0; i < proc.frame->slice_count; i++) {
-			av_picture_copy(&proc.temp_frame, (const AVPicture *)c->frame.current, PIX_FMT_YUV420P,
-							proc.mb_width << mb_size_log, proc.mb_height << mb_size_log);
-			do_replacement(c, &proc.temp_frame, i, NULL);
-			proc.frame->slice[i].direct_quality_loss =
-			ssim_quality_loss(&original, &replaced, &proc.frame->slice[i].rect, ssim_precision);
+		/* calculate the error for each slice individually; temp_frame now has all slices
+		 * replaced, so a single pass binning the window errors by slice does the job,
+		 * windows straddling slices see the original picture outside their own slice */
+		{
+			const ssim_bins_t bins = {
+				.map = proc->slice_map, .line_stride = proc->mb_width,
+				.block_size_log = mb_size_log, .count = proc->frame->slice_count
+			};
+			float *quality_loss = (float *)arena_push(proc->search, proc->frame->slice_count * sizeof(float));
+			
+			/* all ones marks macroblocks outside any slice, slice numbers stay below SLICE_LIMIT */
+			memset(proc->slice_map, 0xFF, proc->mb_width * proc->mb_height * sizeof(uint16_t));
+			for (i = 0; i < proc->frame->slice_count; i++)
+				for (mb = proc->frame->slice[i].start_index; mb < proc->frame->slice[i].end_index; mb++)
+					proc->slice_map[mb] = (uint16_t)i;
+			ssim_quality_loss_binned(&original, &replaced, &bins, ssim_precision, sampling_seed(), quality_loss);
+			for (i = 0; i < proc->frame->slice_count; i++)
+				proc->frame->slice[i].direct_quality_loss = quality_loss[i];
 		}
+		
+		/* the search storage is reused for the next frame, the frame keeps a compact copy of the final tree */
+		proc->frame->replacement = (replacement_node_t *)arena_push(proc->gop, sizeof(replacement_node_t));
+		keep_replacement_node(proc->frame->replacement, node);
 	}
 }
 
@@ -105,16 +130,16 @@ static int search_average_motion(const AVCodecContext *c, replacement_node_t *no
 	/* Step 1: select the reference used most often */
 	for (mb_y = node->start_y; mb_y < node->end_y; mb_y++) {
 		for (mb_x = node->start_x; mb_x < node->end_x; mb_x++) {
-			const int mb_stride = proc.mb_width + 1;
+			const int mb_stride = proc->mb_width + 1;
 			const int mb_index = mb_x + mb_y * mb_stride;
 			const int mb_type = c->frame.current->mb_type[mb_index];
-			const int ref_stride = 2 * proc.mb_width;
+			const int ref_stride = 2 * proc->mb_width;
 			const int ref_index_base = 2*mb_x + 2*mb_y * ref_stride;
 			for (list = 0; list < 2; list++) {
 				if (!USES_LIST(mb_type, list)) continue;
 				for (i = 0; i < 4; i++) {
 					const int ref_index = ref_index_base + (i&1) + (i>>1) * ref_stride;
-					const int ref_num = proc.ref_num[list][ref_index];
+					const int ref_num = proc->ref_num[list][ref_index];
 					ref_count[ref_num]++;
 				}
 			}
@@ -137,12 +162,12 @@ static int search_average_motion(const AVCodecContext *c, replacement_node_t *no
 	x = y = 0;
 	for (mb_y = node->start_y; mb_y < node->end_y; mb_y++) {
 		for (mb_x = node->start_x; mb_x < node->end_x; mb_x++) {
-			const int mb_stride = proc.mb_width + 1;
+			const int mb_stride = proc->mb_width + 1;
 			const int mb_index = mb_x + mb_y * mb_stride;
-			const int ref_stride = 2 * proc.mb_width;
+			const int ref_stride = 2 * proc->mb_width;
 			const int ref_index_base = 2*mb_x + 2*mb_y * ref_stride;
 			const int mv_sample_log2 = 4 - c->frame.current->motion_subsample_log2;
-			const int mv_stride = proc.mb_width << mv_sample_log2;
+			const int mv_stride = proc->mb_width << mv_sample_log2;
 			const int mv_index_base = (mb_x << mv_sample_log2) + (mb_y << mv_sample_log2) * mv_stride;
 			const int mb_type = c->frame.current->mb_type[mb_index];
 			for (list = 0; list < 2; list++) {
@@ -150,7 +175,7 @@ static int search_average_motion(const AVCodecContext *c, replacement_node_t *no
 				for (i = 0; i < 16; i++) {
 					const int ref_index = ref_index_base + ((i>>1)&1) + (i>>3) * ref_stride;
 					const int mv_index = mv_index_base + (i&3) + (i>>2) * mv_stride;
-					if (proc.ref_num[list][ref_index] == node->reference) {
+					if (proc->ref_num[list][ref_index] == node->reference) {
 						if ((IS_16X16(mb_type) && (i&15) == 0) ||
 							(IS_16X8(mb_type) && (i&(15-8)) == 0) ||
 							(IS_8X16(mb_type) && (i&(15-2)) == 0) ||
@@ -175,21 +200,27 @@ static int search_average_motion(const AVCodecContext *c, replacement_node_t *no
 	return 1;
 }
 
-static void cut_nodes(const AVCodecContext *c, replacement_node_t *node,
-					  const picture_t *original, const picture_t *replaced)
+static void cut_nodes(const AVCodecContext *c, replacement_node_t *node)
 {
 	change_rect_t rect;
-	float quality_loss1, quality_loss2;
+	float threshold;
 	replacement_node_t *subnode[4];
+	int cut = 0, decided = 0;
+	unsigned mb_x, mb_y;
+#if PYRAMID_SSIM
+	/* both losses are only measured when level is nonzero */
+	float quality_loss1 = 0.0f, quality_loss2 = 0.0f;
+	unsigned level = 0;
+#endif
 	
 	if (!node || !node->node[0])
     /* no subnodes -> nothing to cut here */
 		return;
 	/* try cutting subnodes first */
-	cut_nodes(c, node->node[0], original, replaced);
-	cut_nodes(c, node->node[1], original, replaced);
-	cut_nodes(c, node->node[2], original, replaced);
-	cut_nodes(c, node->node[3], original, replaced);
+	cut_nodes(c, node->node[0]);
+	cut_nodes(c, node->node[1]);
+	cut_nodes(c, node->node[2]);
+	cut_nodes(c, node->node[3]);
 	if (node->node[0]->node[0] ||
 		node->node[1]->node[0] ||
 		node->node[2]->node[0] ||
@@ -204,58 +235,149 @@ static void cut_nodes(const AVCodecContext *c, replacement_node_t *node,
 	rect.min_y = node->start_y << mb_size_log;
 	rect.max_x = node->end_x << mb_size_log;
 	rect.max_y = node->end_y << mb_size_log;
+	threshold = subdivision_threshold / (1 << (2 * node->depth));
 	
-	/* this is the current quality loss within the current node's area */
-	quality_loss1 = ssim_quality_loss(original, replaced, &rect, ssim_precision);
+#if PYRAMID_SSIM
+	/* large areas are estimated on reduced resolution, the larger the more reduced */
+	if (node->depth <= pyramid_max_depth)
+		level = (pyramid_max_depth + 1 - node->depth < pyramid_levels) ? pyramid_max_depth + 1 - node->depth : pyramid_levels;
+	if (level) {
+		/* reduced resolution needs actual pixels, so bring temp_frame up to date here */
+		do_replacement(c, &proc->temp_frame, SLICE_FRAME, &rect);
+		/* this is the current quality loss within the current node's area */
+		quality_loss1 = ssim_pyramid_quality_loss(proc->ssim_pyramid, &rect, level);
+	}
+#endif
 	
-	/* now cut off the subnodes */
+	/* now cut off the subnodes, the variant patchwork describes the result */
 	memcpy(subnode, node->node, sizeof(node->node));
 	memset(node->node, 0, sizeof(node->node));
-	do_replacement(c, &proc.temp_frame, SLICE_MAX, &rect);
+	for (mb_y = node->start_y; mb_y < node->end_y; mb_y++)
+		for (mb_x = node->start_x; mb_x < node->end_x; mb_x++)
+			set_patch(&proc->variant_patches[mb_x + mb_y * proc->mb_width], node, mb_x, mb_y);
 	
-	/* this is the quality loss with the subnodes removed */
-	quality_loss2 = ssim_quality_loss(original, replaced, &rect, ssim_precision);
+	{
+		const picture_t original = picture(c, (const AVPicture *)c->frame.current);
+		const ssim_patchwork_t with_subnodes = {
+			.patch = proc->patches, .line_stride = proc->mb_width, .block_size_log = mb_size_log
+		};
+		const ssim_patchwork_t without_subnodes = {
+			.patch = proc->variant_patches, .line_stride = proc->mb_width, .block_size_log = mb_size_log
+		};
+		
+#if PYRAMID_SSIM
+		if (level) {
+			/* this is the quality loss with the subnodes removed */
+			do_replacement(c, &proc->temp_frame, SLICE_FRAME, &rect);
+			quality_loss2 = ssim_pyramid_quality_loss(proc->ssim_pyramid, &rect, level);
+			cut = (quality_loss2 - quality_loss1 <= threshold);
+			/* estimates close to the threshold are not trustworthy, decide those at full resolution */
+			decided = (fabsf(quality_loss2 - quality_loss1 - threshold) > pyramid_margin * threshold);
+#if PYRAMID_REPORT
+			proc->pyramid.estimated++;
+			if (!decided)
+				proc->pyramid.refined++;
+			else if (ssim_patchwork_compare(&original, &with_subnodes, &without_subnodes, &rect, threshold, ssim_precision, sampling_seed()) != cut)
+				proc->pyramid.differing++;
+#endif
+		}
+#endif
+		
+		/* does cutting increase the quality loss by no more than the threshold? */
+		if (!decided)
+			cut = ssim_patchwork_compare(&original, &with_subnodes, &without_subnodes, &rect, threshold, ssim_precision, sampling_seed());
+	}
 	
-	if (quality_loss2 - quality_loss1 <= subdivision_threshold / (1 << (2 * node->depth))) {
-		/* the increase in quality loss is adequate, we can delete the subnodes */
-		destroy_replacement_tree(subnode[0]);
-		destroy_replacement_tree(subnode[1]);
-		destroy_replacement_tree(subnode[2]);
-		destroy_replacement_tree(subnode[3]);
+	if (cut) {
+		/* the increase in quality loss is adequate, we can drop the subnodes */
+		copy_patches(proc->patches, proc->variant_patches, node);
 	} else {
 		/* the quality dropped too much, let's reattach the subnodes */
 		memcpy(node->node, subnode, sizeof(node->node));
-		do_replacement(c, &proc.temp_frame, SLICE_MAX, &rect);
+		copy_patches(proc->variant_patches, proc->patches, node);
 	}
 }
 
-#endif
+static picture_t picture(const AVCodecContext *c, const AVPicture *frame)
+{
+	picture_t result;
+	
+	result.Y  = frame->data[0];
+	result.Cb = frame->data[1];
+	result.Cr = frame->data[2];
+	result.line_stride_Y  = frame->linesize[0];
+	result.line_stride_Cb = frame->linesize[1];
+	result.line_stride_Cr = frame->linesize[2];
+	result.width  = c->width;
+	result.height = c->height;
+	
+	return result;
+}
 
-#if PREPROCESS || METADATA_READ
-void destroy_replacement_tree(replacement_node_t *node)
+/* describes what do_replacement() would write into a macroblock for the given node */
+static void set_patch(ssim_patch_t *patch, const replacement_node_t *node, const int mb_x, const int mb_y)
+{
+	const int width = proc->mb_width << mb_size_log;
+	const int height = proc->mb_height << mb_size_log;
+	const int start_x = mb_x << mb_size_log;
+	const int start_y = mb_y << mb_size_log;
+	const int end_x = (mb_x + 1) << mb_size_log;
+	const int end_y = (mb_y + 1) << mb_size_log;
+	int dx = node ? node->x : 0;
+	int dy = node ? node->y : 0;
+	
+	/* motion clipping */
+	if (start_x + dx < 0) dx = -start_x;
+	if (start_y + dy < 0) dy = -start_y;
+	if (end_x + dx > width ) dx = width  - end_x;
+	if (end_y + dy > height) dy = height - end_y;
+	
+	patch->source = (node && node->reference && proc->reference_picture[node->reference + REF_MAX].Y) ?
+		&proc->reference_picture[node->reference + REF_MAX] : NULL;
+	patch->dx = dx;
+	patch->dy = dy;
+	patch->constant[0] = (uint8_t)checkerboard(mb_x, mb_y);
+	patch->constant[1] = patch->constant[2] = 0x80;
+}
+
+static void copy_patches(ssim_patch_t *target, const ssim_patch_t *source, const replacement_node_t *node)
 {
-	if (!node) return;
-	destroy_replacement_tree(node->node[0]);
-	destroy_replacement_tree(node->node[1]);
-	destroy_replacement_tree(node->node[2]);
-	destroy_replacement_tree(node->node[3]);
-	av_free(node);
+	unsigned mb_y;
+	
+	for (mb_y = node->start_y; mb_y < node->end_y; mb_y++)
+		memcpy(&target[node->start_x + mb_y * proc->mb_width], &source[node->start_x + mb_y * proc->mb_width],
+			   (node->end_x - node->start_x) * sizeof(ssim_patch_t));
 }
+
+static void keep_replacement_node(replacement_node_t *target, const replacement_node_t *source)
+{
+	int i;
+	
+	*target = *source;
+	if (!source->node[0]) return;
+	/* the four subnodes are placed next to each other, ahead of their own subtrees */
+	replacement_node_t *const subnode = (replacement_node_t *)arena_push(proc->gop, 4 * sizeof(replacement_node_t));
+	for (i = 0; i < 4; i++)
+		target->node[i] = &subnode[i];
+	for (i = 0; i < 4; i++)
+		keep_replacement_node(&subnode[i], source->node[i]);
+}
+
 #endif
 
 #if PREPROCESS
 void remember_slice_boundaries(const AVCodecContext *c)
 {
-	proc.frame->slice[proc.frame->slice_count].start_index = c->slice.start_index;
-	proc.frame->slice[proc.frame->slice_count].end_index   = c->slice.end_index;
-	proc.frame->slice[proc.frame->slice_count].rect.min_y = ((c->slice.start_index) / proc.mb_width) << mb_size_log;
-	proc.frame->slice[proc.frame->slice_count].rect.max_y = ((c->slice.end_index - 1) / proc.mb_width + 1) << mb_size_log;
-	if (c->slice.start_index / proc.mb_width == (c->slice.end_index - 1) / proc.mb_width) {
-		proc.frame->slice[proc.frame->slice_count].rect.min_x = ((c->slice.start_index) % proc.mb_width) << mb_size_log;
-		proc.frame->slice[proc.frame->slice_count].rect.max_x = ((c->slice.end_index - 1) % proc.mb_width + 1) << mb_size_log;
+	proc->frame->slice[proc->frame->slice_count].start_index = c->slice.start_index;
+	proc->frame->slice[proc->frame->slice_count].end_index   = c->slice.end_index;
+	proc->frame->slice[proc->frame->slice_count].rect.min_y = ((c->slice.start_index) / proc->mb_width) << mb_size_log;
+	proc->frame->slice[proc->frame->slice_count].rect.max_y = ((c->slice.end_index - 1) / proc->mb_width + 1) << mb_size_log;
+	if (c->slice.start_index / proc->mb_width == (c->slice.end_index - 1) / proc->mb_width) {
+		proc->frame->slice[proc->frame->slice_count].rect.min_x = ((c->slice.start_index) % proc->mb_width) << mb_size_log;
+		proc->frame->slice[proc->frame->slice_count].rect.max_x = ((c->slice.end_index - 1) % proc->mb_width + 1) << mb_size_log;
 	} else {
-		proc.frame->slice[proc.frame->slice_count].rect.min_x = 0;
-		proc.frame->slice[proc.frame->slice_count].rect.max_x = c->width;
+		proc->frame->slice[proc->frame->slice_count].rect.min_x = 0;
+		proc->frame->slice[proc->frame->slice_count].rect.max_x = c->width;
 	}
 }
 
@@ -284,20 +406,20 @@ void remember_reference_frames(const AVCodecContext *c)
 	/* now use the translation table to convert from slice-local reference
 	 * numbers to global ones */
 	for (mb = c->slice.start_index; mb < c->slice.end_index; mb++) {
-		const int mb_x = mb % proc.mb_width;
-		const int mb_y = mb / proc.mb_width;
-		const int mb_stride = proc.mb_width + 1;
+		const int mb_x = mb % proc->mb_width;
+		const int mb_y = mb / proc->mb_width;
+		const int mb_stride = proc->mb_width + 1;
 		const int mb_index = mb_x + mb_y * mb_stride;
-		const int ref_stride = 2 * proc.mb_width;
+		const int ref_stride = 2 * proc->mb_width;
 		const int ref_index_base = 2*mb_x + 2*mb_y * ref_stride;
 		for (list = 0; list < 2; list++) {
 			for (i = 0; i < 4; i++) {
 				const int ref_index = ref_index_base + (i&1) + (i>>1) * ref_stride;
 				const int ref_num = c->frame.current->ref_index[list][ref_index];
 				if (USES_LIST(c->frame.current->mb_type[mb_index], list) && ref_num >= 0)
-					proc.ref_num[list][ref_index] = translate[list][ref_num];
+					proc->ref_num[list][ref_index] = translate[list][ref_num];
 				else
-					proc.ref_num[list][ref_index] = 0;
+					proc->ref_num[list][ref_index] = 0;
 			}
 		}
 	}
@@ -316,12 +438,22 @@ static inline const replacement_node_t *get_replacement_node(const replacement_n
 	return get_replacement_node(node->node[(decision_y << 1) | decision_x], mb_x, mb_y);
 }
 
+static inline const AVFrame *get_replacement_frame(const AVCodecContext *c, const replacement_node_t *node)
+{
+	return
+	node ?
+	(((node->reference < 0) ? c->reference.long_list[-node->reference - 1] :
+	  ((node->reference == 0) ? NULL :
+	   ((node->reference > 0) ? c->reference.short_list[node->reference - 1] : NULL)))) :
+	NULL;
+}
+
 float do_replacement(const AVCodecContext *c, const AVPicture *frame, int slice, const change_rect_t *rect)
 {
 	int mb, x, y;
 	double error = 0.0;
-	const int width = proc.mb_width << mb_size_log;
-	const int height = proc.mb_height << mb_size_log;
+	const int width = proc->mb_width << mb_size_log;
+	const int height = proc->mb_height << mb_size_log;
 #if !PREPROCESS
 	int mb_add;
 #endif
@@ -363,9 +495,9 @@ float do_replacement(const AVCodecContext *c, const AVPicture *frame, int slice,
 	}
 #endif
 	
-	for (mb = proc.frame->slice[slice].start_index; mb < proc.frame->slice[slice].end_index; mb++) {
-		const int mb_x = mb % proc.mb_width;
-		const int mb_y = mb / proc.mb_width;
+	for (mb = proc->frame->slice[slice].start_index; mb < proc->frame->slice[slice].end_index; mb++) {
+		const int mb_x = mb % proc->mb_width;
+		const int mb_y = mb / proc->mb_width;
 		int start_x = mb_x << mb_size_log;
 		int start_y = mb_y << mb_size_log;
 		int end_x = (mb_x + 1) << mb_size_log;
@@ -377,13 +509,8 @@ float do_replacement(const AVCodecContext *c, const AVPicture *frame, int slice,
 			(end_x > rect->min_x && start_x < rect->max_x &&
 			 end_y > rect->min_y && start_y < rect->max_y)) {
 #endif
-			const replacement_node_t *const restrict node = get_replacement_node(proc.frame->replacement, mb_x, mb_y);
-			const AVFrame *const restrict replace =
-				node ?
-				(((node->reference < 0) ? c->reference.long_list[-node->reference - 1] :
-				  ((node->reference == 0) ? NULL :
-				   ((node->reference > 0) ? c->reference.short_list[node->reference - 1] : NULL)))) :
-				NULL;
+			const replacement_node_t *const restrict node = get_replacement_node(proc->frame->replacement, mb_x, mb_y);
+			const AVFrame *const restrict replace = get_replacement_frame(c, node);
 			uint8_t * restrict target = frame->data[0];
 			const uint8_t * restrict source = replace ? replace->data[0] : NULL;
 			int stride1 = frame->linesize[0];
@@ -403,7 +530,7 @@ float do_replacement(const AVCodecContext *c, const AVPicture *frame, int slice,
 				if (end_x + (mb_add << mb_size_log) + dx > width)
 				/* motion vector clipping starts here */
 					break;
-				if (mb + mb_add == proc.frame->slice[slice].end_index)
+				if (mb + mb_add == proc->frame->slice[slice].end_index)
 				/* slice ends here */
 					break;
 			}
@@ -429,6 +556,14 @@ float do_replacement(const AVCodecContext *c, const AVPicture *frame, int slice,
 					for (x = start_x; x < end_x; x += sizeof(byte_block_t))
 						BLOCK(target, x + y * stride1) = checkerboard(mb_x, mb_y);
 							
+#if PREPROCESS && PYRAMID_SSIM
+			/* the reduced copies of temp_frame follow its changes */
+			if (frame == &proc->temp_frame) {
+				const change_rect_t written = { .min_x = start_x, .min_y = start_y, .max_x = end_x, .max_y = end_y };
+				ssim_pyramid_update(proc->ssim_pyramid, &written);
+			}
+#endif
+			
 			start_x = mb_x << (mb_size_log - 1);
 			start_y = mb_y << (mb_size_log - 1);
 #if PREPROCESS
@@ -478,12 +613,12 @@ float do_replacement(const AVCodecContext *c, const AVPicture *frame, int slice,
 			 * synthesize some metadata (namely macroblock type, reference index and motion vector)
 			 * which FFmpeg might use for direct coded macroblocks of future frames */
 			for (x = mb_x; x < mb_x + mb_add + 1; x++) {
-				const int mb_stride = proc.mb_width + 1;
+				const int mb_stride = proc->mb_width + 1;
 				const int mb_index = x + mb_y * mb_stride;
-				const int ref_stride = 2 * proc.mb_width;
+				const int ref_stride = 2 * proc->mb_width;
 				const int ref_index_base = 2*x + 2*mb_y * ref_stride;
 				const int mv_sample_log2 = 4 - c->frame.current->motion_subsample_log2;
-				const int mv_stride = proc.mb_width << mv_sample_log2;
+				const int mv_stride = proc->mb_width << mv_sample_log2;
 				const int mv_index_base = (x << mv_sample_log2) + (mb_y << mv_sample_log2) * mv_stride;
 				const int list = translate[node->reference].list;
 				int i;
@@ -522,26 +657,114 @@ float do_replacement(const AVCodecContext *c, const AVPicture *frame, int slice,
 
 #endif
 
+/* flags are stored in groups as one varint, which holds seven of them in a single byte */
+#define REPLACEMENT_FLAG_GROUP 7
+
 #if METADATA_WRITE && (PREPROCESS || METADATA_READ)
+/* up to version 2, every leaf is stored with its depth */
+static void write_replacement_depths(const replacement_node_t *node)
+{
+	if (!node->node[0]) {
+		nalu_write_unsigned(proc->metadata.write, node->depth);
+		nalu_write_signed(proc->metadata.write, node->reference);
+		nalu_write_signed(proc->metadata.write, node->x);
+		nalu_write_signed(proc->metadata.write, node->y);
+	} else {
+		write_replacement_depths(node->node[0]);
+		write_replacement_depths(node->node[1]);
+		write_replacement_depths(node->node[2]);
+		write_replacement_depths(node->node[3]);
+	}
+}
+
+typedef struct {
+	/* the flags of a tree in coding order: a presence flag, then a split flag per node and a repeat flag per leaf */
+	bool *flag;
+	size_t count, capacity;
+	/* the first pass collects the flags, the second writes each group ahead of its first flag */
+	bool emit;
+	size_t position;
+} replacement_flags_t;
+
+static void write_replacement_flag(replacement_flags_t *flags, bool value)
+{
+	if (!flags->emit) {
+		if (flags->count == flags->capacity) {
+			flags->capacity = flags->capacity ? 2 * flags->capacity : 256;
+			flags->flag = realloc(flags->flag, flags->capacity * sizeof(bool));
+			if (!flags->flag) {
+				fprintf(stderr, "could not allocate the replacement tree flags\n");
+				abort();
+			}
+		}
+		flags->flag[flags->count++] = value;
+		return;
+	}
+	
+	if (flags->position % REPLACEMENT_FLAG_GROUP == 0) {
+		/* the first flag of a group is its least significant bit */
+		const size_t end = (flags->position + REPLACEMENT_FLAG_GROUP < flags->count) ?
+			flags->position + REPLACEMENT_FLAG_GROUP : flags->count;
+		uint_fast32_t group = 0;
+		for (size_t i = end; i-- > flags->position;)
+			group = (group << 1) | flags->flag[i];
+		nalu_write_unsigned(proc->metadata.write, group);
+	}
+	flags->position++;
+}
+
+static void write_replacement_node(const replacement_node_t *node, replacement_node_t *previous, replacement_flags_t *flags)
+{
+	write_replacement_flag(flags, node->node[0] != NULL);
+	if (node->node[0]) {
+		write_replacement_node(node->node[0], previous, flags);
+		write_replacement_node(node->node[1], previous, flags);
+		write_replacement_node(node->node[2], previous, flags);
+		write_replacement_node(node->node[3], previous, flags);
+		return;
+	}
+	
+	/* the previous leaf is a spatial neighbor, neighboring leaves often share the replacement */
+	const bool repeat = (node->reference == previous->reference && node->x == previous->x && node->y == previous->y);
+	write_replacement_flag(flags, repeat);
+	if (!repeat) {
+		if (flags->emit) {
+			nalu_write_signed(proc->metadata.write, node->reference - previous->reference);
+			nalu_write_signed(proc->metadata.write, node->x - previous->x);
+			nalu_write_signed(proc->metadata.write, node->y - previous->y);
+		}
+		previous->reference = node->reference;
+		previous->x = node->x;
+		previous->y = node->y;
+	}
+}
+
 void write_replacement_tree(const replacement_node_t *node)
 {
-	if (!node) {
-		/* this must be the root node; treat as a special case, since we must write something */
-		nalu_write_unsigned(proc.metadata.write, 0);
-		nalu_write_signed(proc.metadata.write, 0);
+	replacement_flags_t flags = { .flag = NULL, .count = 0, .capacity = 0 };
+	
+	if (nalu_write_version(proc->metadata.write) < 3) {
+		if (node) {
+			write_replacement_depths(node);
+		} else {
+			/* the empty tree is a root leaf with the invalid reference zero */
+			nalu_write_unsigned(proc->metadata.write, 0);
+			nalu_write_signed(proc->metadata.write, 0);
+		}
 		return;
 	}
-	if (!node->node[0]) {
-		nalu_write_unsigned(proc.metadata.write, node->depth);
-		nalu_write_signed(proc.metadata.write, node->reference);
-		nalu_write_signed(proc.metadata.write, node->x);
-		nalu_write_signed(proc.metadata.write, node->y);
-	} else {
-		write_replacement_tree(node->node[0]);
-		write_replacement_tree(node->node[1]);
-		write_replacement_tree(node->node[2]);
-		write_replacement_tree(node->node[3]);
+	
+	/* a presence flag, then the nodes in depth-first order; leaves are coded relative to
+	 * the previous leaf, the first relative to the closest reference */
+	for (int pass = 0; pass < 2; pass++) {
+		replacement_node_t previous = { .reference = 1, .x = 0, .y = 0 };
+		flags.emit = pass;
+		flags.position = 0;
+		write_replacement_flag(&flags, node != NULL);
+		if (node)
+			write_replacement_node(node, &previous, &flags);
 	}
+	free(flags.flag);
 }
 #endif
 
@@ -595,62 +818,66 @@ static int fill_coordinates(replacement_node_t *node)
 {
 	const unsigned x = index_to_x(node->index);
 	const unsigned y = index_to_y(node->index);
-	node->start_x = block_to_mb(x    , proc.mb_width , node->depth);
-	node->start_y = block_to_mb(y    , proc.mb_height, node->depth);
-	node->end_x   = block_to_mb(x + 1, proc.mb_width , node->depth);
-	node->end_y   = block_to_mb(y + 1, proc.mb_height, node->depth);
+	node->start_x = block_to_mb(x    , proc->mb_width , node->depth);
+	node->start_y = block_to_mb(y    , proc->mb_height, node->depth);
+	node->end_x   = block_to_mb(x + 1, proc->mb_width , node->depth);
+	node->end_y   = block_to_mb(y + 1, proc->mb_height, node->depth);
 	return (node->start_x < node->end_x && node->start_y < node->end_y);
 }
 #endif
 
 #if METADATA_READ
-void read_replacement_tree(replacement_node_t *node)
+static replacement_node_t *init_node(replacement_node_t *node, unsigned depth, unsigned index)
+{
+	node->depth = depth;
+	node->index = index;
+	node->node[0] = node->node[1] = node->node[2] = node->node[3] = NULL;
+	fill_coordinates(node);
+	return node;
+}
+
+static replacement_node_t *create_node(unsigned depth, unsigned index)
+{
+	return init_node((replacement_node_t *)arena_push(proc->gop, sizeof(replacement_node_t)), depth, index);
+}
+
+/* up to version 2, every leaf is stored with its depth */
+static void read_replacement_depths(replacement_node_t *node)
 {
 	static const int read_next_depth = -1;
-	static int depth;
 	
 	if (!node) {
 		/* initialize the root node */
-		node = (replacement_node_t *)av_malloc(sizeof(replacement_node_t));
-		proc.frame->replacement = node;
-		node->depth = 0;
-		node->index = 0;
-		node->node[0] = node->node[1] = node->node[2] = node->node[3] = NULL;
-		fill_coordinates(node);
-		depth = read_next_depth;
+		node = proc->frame->replacement = create_node(0, 0);
+		proc->replacement_depth = read_next_depth;
 	}
 	
 	while (1) {
 		if (node->node[0] && node->node[1] && node->node[2] && node->node[3])
 			/* nothing left to do here, this subtree is finished */
 			return;
-		if (depth == read_next_depth)
-			depth = nalu_read_unsigned(proc.metadata.read);
-		if (depth == node->depth) {
+		if (proc->replacement_depth == read_next_depth)
+			proc->replacement_depth = nalu_read_unsigned(proc->metadata.read);
+		if (proc->replacement_depth == node->depth) {
 			/* this is our node */
-			node->reference = nalu_read_signed(proc.metadata.read);
+			node->reference = nalu_read_signed(proc->metadata.read);
 			if (!node->reference) {
-				/* special case: empty root node */
-				av_free(node);
-				proc.frame->replacement = NULL;
+				/* special case: empty root node, dropped with the GOP storage */
+				proc->frame->replacement = NULL;
 				return;
 			}
-			node->x = nalu_read_signed(proc.metadata.read);
-			node->y = nalu_read_signed(proc.metadata.read);
-			depth = read_next_depth;
+			node->x = nalu_read_signed(proc->metadata.read);
+			node->y = nalu_read_signed(proc->metadata.read);
+			proc->replacement_depth = read_next_depth;
 			return;
 		}
-		if (depth > node->depth) {
+		if (proc->replacement_depth > node->depth) {
 			/* the next node is a subnode of the current one */
 			int i;
 			for (i = 0; i < 4; i++) {
 				if (!node->node[i]) {
-					node->node[i] = (replacement_node_t *)av_malloc(sizeof(replacement_node_t));
-					node->node[i]->depth = node->depth + 1;
-					node->node[i]->index = node->index * 4 + i;
-					node->node[i]->node[0] = node->node[i]->node[1] = node->node[i]->node[2] = node->node[i]->node[3] = NULL;
-					fill_coordinates(node->node[i]);
-					read_replacement_tree(node->node[i]);
+					node->node[i] = create_node(node->depth + 1, node->index * 4 + i);
+					read_replacement_depths(node->node[i]);
 					break;
 				}
 			}
@@ -659,4 +886,63 @@ void read_replacement_tree(replacement_node_t *node)
 		}
 	}
 }
+
+/* the node index holds two bits per level */
+#define REPLACEMENT_DEPTH_MAX 15
+
+/* the reader takes the next group of flags whenever it runs out */
+static inline bool read_replacement_flag(uint_fast32_t *group, unsigned *left)
+{
+	if (!*left) {
+		*group = nalu_read_unsigned(proc->metadata.read);
+		*left = REPLACEMENT_FLAG_GROUP;
+	}
+	const bool flag = *group & 1;
+	*group >>= 1;
+	(*left)--;
+	return flag;
+}
+
+void read_replacement_tree(void)
+{
+	/* nodes not yet read, every split replaces one pending node with four */
+	replacement_node_t *pending[3 * REPLACEMENT_DEPTH_MAX + 1];
+	size_t count = 0;
+	int reference = 1, x = 0, y = 0;
+	uint_fast32_t group = 0;
+	unsigned left = 0;
+	
+	if (nalu_read_version(proc->metadata.read) < 3) {
+		read_replacement_depths(NULL);
+		return;
+	}
+	
+	proc->frame->replacement = NULL;
+	if (!read_replacement_flag(&group, &left))
+		return;
+	
+	pending[count++] = proc->frame->replacement = create_node(0, 0);
+	while (count) {
+		replacement_node_t *node = pending[--count];
+		if (read_replacement_flag(&group, &left)) {
+			if (node->depth >= REPLACEMENT_DEPTH_MAX) {
+				fprintf(stderr, "replacement tree exceeds the maximum depth of %d\n", REPLACEMENT_DEPTH_MAX);
+				abort();
+			}
+			/* the four subnodes are placed next to each other, push in reverse, so the first one is read next */
+			replacement_node_t *const subnode = (replacement_node_t *)arena_push(proc->gop, 4 * sizeof(replacement_node_t));
+			for (int i = 3; i >= 0; i--)
+				pending[count++] = node->node[i] = init_node(&subnode[i], node->depth + 1, 4 * node->index + (unsigned)i);
+		} else {
+			if (!read_replacement_flag(&group, &left)) {
+				reference += nalu_read_signed(proc->metadata.read);
+				x += nalu_read_signed(proc->metadata.read);
+				y += nalu_read_signed(proc->metadata.read);
+			}
+			node->reference = reference;
+			node->x = x;
+			node->y = y;
+		}
+	}
+}
 #endif
@@ -5,18 +5,20 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
+#include <math.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "ssim.h"
 
-#ifdef __SSE__
-#include <xmmintrin.h>
-#ifdef __SSE3__
-#include <pmmintrin.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define KERNELS_X86 1
 #else
-#define HORIZ_ADD(x)  (x[0] + x[1] + x[2] + x[3])
-#endif
+#define KERNELS_X86 0
 #endif
 
 #define BLOCK_WIDTH  8
@@ -25,6 +27,18 @@
 
 #define N (BLOCK_WIDTH * BLOCK_HEIGHT)
 
+/* rows of window positions handled by one sliding window pass in ssim_map() */
+#define MAP_BAND_HEIGHT 32
+/* rows of window positions forming one tile of parallel work in ssim_quality_loss() */
+#define QUALITY_BAND_HEIGHT 16
+/* maximum number of 2x reductions a pyramid keeps of its pictures */
+#define PYRAMID_LEVELS 2
+/* sequential comparison: samples before the first test, samples between tests,
+ * and the normal quantile of the two-sided confidence interval (99%) */
+#define COMPARE_MIN_SAMPLES 64
+#define COMPARE_BATCH 16
+#define COMPARE_Z 2.576
+
 #define K1 0.01
 #define K2 0.03
 #define L 255.0
@@ -37,91 +51,15 @@
 #define WEIGHT_CR 0.1
 
 
-static double ssim_block(const uint8_t * restrict x, const uint8_t * restrict y,
-                         const uint_fast32_t line_stride_x, const uint_fast32_t line_stride_y)
+/* running sums over a column or a window of pixels; all sums are exact integers,
+ * a window of 8x8 squared 8-bit values comfortably fits 32 bits */
+typedef struct {
+	uint32_t x, y, xx, yy, xy;
+} ssim_sums_t;
+
+/* turns the raw sums over one window into the SSIM index */
+static inline double ssim_from_sums(double mean_x, double mean_y, double var_x, double var_y, double covar_xy)
 {
-#ifdef __SSE__
-	__m128 vec_mean_x   = { 0.0, 0.0, 0.0, 0.0 };
-	__m128 vec_mean_y   = { 0.0, 0.0, 0.0, 0.0 };
-	__m128 vec_var_x    = { 0.0, 0.0, 0.0, 0.0 };
-	__m128 vec_var_y    = { 0.0, 0.0, 0.0, 0.0 };
-	__m128 vec_covar_xy = { 0.0, 0.0, 0.0, 0.0 };
-	__m128 vec_x;
-	__m128 vec_y;
-	float unpack[4] __attribute__((aligned(16)));
-#endif
-	double mean_x   = 0.0;
-	double mean_y   = 0.0;
-	double var_x    = 0.0;
-	double var_y    = 0.0;
-	double covar_xy = 0.0;
-	unsigned i, j;
-	
-#ifdef __SSE__
-	assert(BLOCK_WIDTH % 4 == 0);
-	
-	for (i = 0; i < BLOCK_HEIGHT; i++) {
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wcast-qual"
-		_mm_prefetch(x + i * line_stride_x, _MM_HINT_T0);
-		_mm_prefetch(y + i * line_stride_y, _MM_HINT_T0);
-#pragma clang diagnostic pop
-		for (j = 0; j < BLOCK_WIDTH; j += 4) {
-			unpack[0] = (float)x[i * line_stride_x + (j + 0) * PIXEL_STRIDE];
-			unpack[1] = (float)x[i * line_stride_x + (j + 1) * PIXEL_STRIDE];
-			unpack[2] = (float)x[i * line_stride_x + (j + 2) * PIXEL_STRIDE];
-			unpack[3] = (float)x[i * line_stride_x + (j + 3) * PIXEL_STRIDE];
-			vec_x = _mm_load_ps(unpack);
-			unpack[0] = (float)y[i * line_stride_y + (j + 0) * PIXEL_STRIDE];
-			unpack[1] = (float)y[i * line_stride_y + (j + 1) * PIXEL_STRIDE];
-			unpack[2] = (float)y[i * line_stride_y + (j + 2) * PIXEL_STRIDE];
-			unpack[3] = (float)y[i * line_stride_y + (j + 3) * PIXEL_STRIDE];
-			vec_y = _mm_load_ps(unpack);
-			vec_mean_x   = _mm_add_ps(vec_x, vec_mean_x);
-			vec_mean_y   = _mm_add_ps(vec_y, vec_mean_y);
-			vec_var_x    = _mm_add_ps(_mm_mul_ps(vec_x, vec_x), vec_var_x);
-			vec_var_y    = _mm_add_ps(_mm_mul_ps(vec_y, vec_y), vec_var_y);
-			vec_covar_xy = _mm_add_ps(_mm_mul_ps(vec_x, vec_y), vec_covar_xy);
-		}
-	}
-#ifdef __SSE3__
-	__m128 zero = _mm_setzero_ps();
-	_mm_store_ss(unpack, _mm_hadd_ps(_mm_hadd_ps(vec_mean_x, zero), zero));
-	mean_x = unpack[0];
-	_mm_store_ss(unpack, _mm_hadd_ps(_mm_hadd_ps(vec_mean_y, zero), zero));
-	mean_y = unpack[0];
-	_mm_store_ss(unpack, _mm_hadd_ps(_mm_hadd_ps(vec_var_x, zero), zero));
-	var_x = unpack[0];
-	_mm_store_ss(unpack, _mm_hadd_ps(_mm_hadd_ps(vec_var_y, zero), zero));
-	var_y = unpack[0];
-	_mm_store_ss(unpack, _mm_hadd_ps(_mm_hadd_ps(vec_covar_xy, zero), zero));
-	covar_xy = unpack[0];
-#else
-	_mm_store_ps(unpack, vec_mean_x);
-	mean_x = HORIZ_ADD(unpack);
-	_mm_store_ps(unpack, vec_mean_y);
-	mean_y = HORIZ_ADD(unpack);
-	_mm_store_ps(unpack, vec_var_x);
-	var_x = HORIZ_ADD(unpack);
-	_mm_store_ps(unpack, vec_var_y);
-	var_y = HORIZ_ADD(unpack);
-	_mm_store_ps(unpack, vec_covar_xy);
-	covar_xy = HORIZ_ADD(unpack);
-#endif
-#else
-	for (i = 0; i < BLOCK_HEIGHT; i++) {
-		for (j = 0; j < BLOCK_WIDTH; j++) {
-			const float x_ij = (float)x[i * line_stride_x + j * PIXEL_STRIDE];
-			const float y_ij = (float)y[i * line_stride_y + j * PIXEL_STRIDE];
-			mean_x   += x_ij;
-			mean_y   += y_ij;
-			var_x    += x_ij * x_ij;
-			var_y    += y_ij * y_ij;
-			covar_xy += x_ij * y_ij;
-		}
-	}
-#endif
-	
 	mean_x /= N;
 	mean_y /= N;
 	var_x    = (var_x    / (N-1)) - (N / (N-1) * mean_x * mean_x);
@@ -132,74 +70,811 @@ static double ssim_block(const uint8_t * restrict x, const uint8_t * restrict y,
     ((mean_x*mean_x + mean_y*mean_y + C1) * (var_x + var_y + C2));
 }
 
+#pragma mark Window Kernels
+
+/* the kernels calculate the sums over one window; the SIMD variants use
+ * widening integer multiply-adds and are selected at runtime, so a binary
+ * built for an old baseline CPU still uses the vector units of newer ones */
+
+static void block_sums_scalar(const uint8_t * restrict x, const uint8_t * restrict y,
+							  const uint_fast32_t line_stride_x, const uint_fast32_t line_stride_y,
+							  ssim_sums_t * restrict sums)
+{
+	uint32_t sum_x = 0, sum_y = 0, sum_xx = 0, sum_yy = 0, sum_xy = 0;
+	
+	for (uint_fast32_t i = 0; i < BLOCK_HEIGHT; i++) {
+		for (uint_fast32_t j = 0; j < BLOCK_WIDTH; j++) {
+			const uint32_t x_ij = x[i * line_stride_x + j * PIXEL_STRIDE];
+			const uint32_t y_ij = y[i * line_stride_y + j * PIXEL_STRIDE];
+			sum_x  += x_ij;
+			sum_y  += y_ij;
+			sum_xx += x_ij * x_ij;
+			sum_yy += y_ij * y_ij;
+			sum_xy += x_ij * y_ij;
+		}
+	}
+	
+	*sums = (ssim_sums_t){ sum_x, sum_y, sum_xx, sum_yy, sum_xy };
+}
+
+#if KERNELS_X86
+
+/* eight pixels into the lower half of a vector; rows have no particular alignment,
+ * so the pointer is passed on without claiming the alignment of __m128i */
+static inline __m128i load_row(const void *row)
+{
+	return _mm_loadl_epi64(row);
+}
+
+static inline uint32_t horizontal_sum(__m128i vec)
+{
+	vec = _mm_add_epi32(vec, _mm_shuffle_epi32(vec, _MM_SHUFFLE(1, 0, 3, 2)));
+	vec = _mm_add_epi32(vec, _mm_shuffle_epi32(vec, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (uint32_t)_mm_cvtsi128_si32(vec);
+}
+
+__attribute__((target("sse4.1")))
+static void block_sums_sse41(const uint8_t * restrict x, const uint8_t * restrict y,
+							 const uint_fast32_t line_stride_x, const uint_fast32_t line_stride_y,
+							 ssim_sums_t * restrict sums)
+{
+	/* one row of eight pixels, widened to 16 bit; plain sums stay below 8 * 8 * 255 and fit 16 bit,
+	 * products are formed and pairwise added by the 32 bit multiply-add */
+	__m128i vec_x  = _mm_setzero_si128();
+	__m128i vec_y  = _mm_setzero_si128();
+	__m128i vec_xx = _mm_setzero_si128();
+	__m128i vec_yy = _mm_setzero_si128();
+	__m128i vec_xy = _mm_setzero_si128();
+	
+	assert(BLOCK_WIDTH == 8 && PIXEL_STRIDE == 1);
+	
+	for (uint_fast32_t i = 0; i < BLOCK_HEIGHT; i++) {
+		const __m128i row_x = _mm_cvtepu8_epi16(load_row(&x[i * line_stride_x]));
+		const __m128i row_y = _mm_cvtepu8_epi16(load_row(&y[i * line_stride_y]));
+		vec_x  = _mm_add_epi16(vec_x, row_x);
+		vec_y  = _mm_add_epi16(vec_y, row_y);
+		vec_xx = _mm_add_epi32(vec_xx, _mm_madd_epi16(row_x, row_x));
+		vec_yy = _mm_add_epi32(vec_yy, _mm_madd_epi16(row_y, row_y));
+		vec_xy = _mm_add_epi32(vec_xy, _mm_madd_epi16(row_x, row_y));
+	}
+	
+	const __m128i ones = _mm_set1_epi16(1);
+	sums->x  = horizontal_sum(_mm_madd_epi16(vec_x, ones));
+	sums->y  = horizontal_sum(_mm_madd_epi16(vec_y, ones));
+	sums->xx = horizontal_sum(vec_xx);
+	sums->yy = horizontal_sum(vec_yy);
+	sums->xy = horizontal_sum(vec_xy);
+}
+
+__attribute__((target("avx2")))
+static void block_sums_avx2(const uint8_t * restrict x, const uint8_t * restrict y,
+							const uint_fast32_t line_stride_x, const uint_fast32_t line_stride_y,
+							ssim_sums_t * restrict sums)
+{
+	/* same as the SSE4.1 kernel, but with two rows per vector */
+	__m256i vec_x  = _mm256_setzero_si256();
+	__m256i vec_y  = _mm256_setzero_si256();
+	__m256i vec_xx = _mm256_setzero_si256();
+	__m256i vec_yy = _mm256_setzero_si256();
+	__m256i vec_xy = _mm256_setzero_si256();
+	
+	assert(BLOCK_WIDTH == 8 && BLOCK_HEIGHT % 2 == 0 && PIXEL_STRIDE == 1);
+	
+	for (uint_fast32_t i = 0; i < BLOCK_HEIGHT; i += 2) {
+		const __m256i rows_x = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(
+			load_row(&x[(i + 0) * line_stride_x]),
+			load_row(&x[(i + 1) * line_stride_x])));
+		const __m256i rows_y = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(
+			load_row(&y[(i + 0) * line_stride_y]),
+			load_row(&y[(i + 1) * line_stride_y])));
+		vec_x  = _mm256_add_epi16(vec_x, rows_x);
+		vec_y  = _mm256_add_epi16(vec_y, rows_y);
+		vec_xx = _mm256_add_epi32(vec_xx, _mm256_madd_epi16(rows_x, rows_x));
+		vec_yy = _mm256_add_epi32(vec_yy, _mm256_madd_epi16(rows_y, rows_y));
+		vec_xy = _mm256_add_epi32(vec_xy, _mm256_madd_epi16(rows_x, rows_y));
+	}
+	
+	const __m256i ones = _mm256_set1_epi16(1);
+	vec_x = _mm256_madd_epi16(vec_x, ones);
+	vec_y = _mm256_madd_epi16(vec_y, ones);
+#define FOLD(vec) _mm_add_epi32(_mm256_castsi256_si128(vec), _mm256_extracti128_si256(vec, 1))
+	sums->x  = horizontal_sum(FOLD(vec_x));
+	sums->y  = horizontal_sum(FOLD(vec_y));
+	sums->xx = horizontal_sum(FOLD(vec_xx));
+	sums->yy = horizontal_sum(FOLD(vec_yy));
+	sums->xy = horizontal_sum(FOLD(vec_xy));
+#undef FOLD
+}
+
+static uint64_t xgetbv(void)
+{
+	uint32_t eax, edx;
+	/* xgetbv opcode spelled out for old assemblers */
+	__asm__ volatile (".byte 0x0f, 0x01, 0xd0" : "=a" (eax), "=d" (edx) : "c" (0));
+	return ((uint64_t)edx << 32) | eax;
+}
+
+#endif
+
+static bool kernel_supported(ssim_kernel_t kernel)
+{
+#if KERNELS_X86
+	unsigned eax, ebx, ecx, edx;
+#endif
+	
+	switch (kernel) {
+		case SSIM_KERNEL_SCALAR:
+			return true;
+#if KERNELS_X86
+		case SSIM_KERNEL_SSE41:
+			if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+			return (ecx & bit_SSE4_1) != 0;
+		case SSIM_KERNEL_AVX2:
+			if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+			if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) return false;
+			/* the operating system must preserve the YMM registers */
+			if ((xgetbv() & 0x6) != 0x6) return false;
+			if (__get_cpuid_max(0, NULL) < 7) return false;
+			__cpuid_count(7, 0, eax, ebx, ecx, edx);
+			return (ebx & bit_AVX2) != 0;
+#endif
+		default:
+			return false;
+	}
+}
+
+typedef void block_sums_t(const uint8_t * restrict x, const uint8_t * restrict y,
+						  const uint_fast32_t line_stride_x, const uint_fast32_t line_stride_y,
+						  ssim_sums_t * restrict sums);
+
+static block_sums_t *block_sums = block_sums_scalar;
+static ssim_kernel_t block_kernel = SSIM_KERNEL_SCALAR;
+/* the automatic choice happens exactly once, even with several decoders starting concurrently */
+static pthread_once_t kernel_chosen = PTHREAD_ONCE_INIT;
+
+static bool kernel_set(ssim_kernel_t kernel)
+{
+	if (kernel == SSIM_KERNEL_AUTO) {
+		/* pick the best one available */
+		if (kernel_supported(SSIM_KERNEL_AVX2))
+			kernel = SSIM_KERNEL_AVX2;
+		else if (kernel_supported(SSIM_KERNEL_SSE41))
+			kernel = SSIM_KERNEL_SSE41;
+		else
+			kernel = SSIM_KERNEL_SCALAR;
+	}
+	if (!kernel_supported(kernel))
+		return false;
+	
+	switch (kernel) {
+#if KERNELS_X86
+		case SSIM_KERNEL_AVX2:
+			block_sums = block_sums_avx2;
+			break;
+		case SSIM_KERNEL_SSE41:
+			block_sums = block_sums_sse41;
+			break;
+#endif
+		default:
+			block_sums = block_sums_scalar;
+	}
+	block_kernel = kernel;
+	return true;
+}
+
+static void kernel_init(void)
+{
+	kernel_set(SSIM_KERNEL_AUTO);
+}
+
+bool ssim_kernel_select(ssim_kernel_t kernel)
+{
+	/* run the automatic choice first, so it cannot override this one later */
+	pthread_once(&kernel_chosen, kernel_init);
+	return kernel_set(kernel);
+}
+
+ssim_kernel_t ssim_kernel(void)
+{
+	pthread_once(&kernel_chosen, kernel_init);
+	return block_kernel;
+}
+
+static inline double ssim_block(const uint8_t * restrict x, const uint8_t * restrict y,
+								const uint_fast32_t line_stride_x, const uint_fast32_t line_stride_y)
+{
+	ssim_sums_t sums;
+	block_sums(x, y, line_stride_x, line_stride_y, &sums);
+	return ssim_from_sums(sums.x, sums.y, sums.xx, sums.yy, sums.xy);
+}
+
+#pragma mark -
+
+
+#pragma mark SSIM Map
+
+static inline void sums_add_pixel(ssim_sums_t *sums, const uint32_t x, const uint32_t y)
+{
+	sums->x  += x;
+	sums->y  += y;
+	sums->xx += x * x;
+	sums->yy += y * y;
+	sums->xy += x * y;
+}
+
+static inline void sums_sub_pixel(ssim_sums_t *sums, const uint32_t x, const uint32_t y)
+{
+	sums->x  -= x;
+	sums->y  -= y;
+	sums->xx -= x * x;
+	sums->yy -= y * y;
+	sums->xy -= x * y;
+}
+
+static inline void map_store(uint8_t * restrict map, float * restrict hist, const double ssim,
+							 const uint_fast32_t i, const uint_fast32_t j,
+							 const unsigned width, const unsigned line_stride)
+{
+	if (hist)
+		hist[(i + (BLOCK_HEIGHT / 2)) * width + (j + (BLOCK_WIDTH / 2)) * PIXEL_STRIDE] += ssim;
+	if (ssim <= 0.0)
+		map[(i + (BLOCK_HEIGHT / 2)) * line_stride + (j + (BLOCK_WIDTH / 2)) * PIXEL_STRIDE] = 0;
+	else if (ssim >= 1.0)
+		map[(i + (BLOCK_HEIGHT / 2)) * line_stride + (j + (BLOCK_WIDTH / 2)) * PIXEL_STRIDE] = 255;
+	else
+		map[(i + (BLOCK_HEIGHT / 2)) * line_stride + (j + (BLOCK_WIDTH / 2)) * PIXEL_STRIDE] = (uint8_t)(255 * ssim);
+}
+
+/* sliding window over a band of rows: column sums are updated by adding the row entering
+ * the window and subtracting the row leaving it, the window sum then slides along the
+ * columns the same way, so every window position costs a constant amount of work */
+static void ssim_map_band(const uint8_t * restrict x, const uint8_t * restrict y,
+						  uint8_t * restrict map, float * restrict hist, ssim_sums_t * restrict column,
+						  const unsigned width, const unsigned line_stride,
+						  const uint_fast32_t first_row, const uint_fast32_t end_row)
+{
+	for (uint_fast32_t j = 0; j < width; j++) {
+		column[j] = (ssim_sums_t){ 0, 0, 0, 0, 0 };
+		for (uint_fast32_t k = 0; k < BLOCK_HEIGHT; k++)
+			sums_add_pixel(&column[j], x[(first_row + k) * line_stride + j * PIXEL_STRIDE],
+						   y[(first_row + k) * line_stride + j * PIXEL_STRIDE]);
+	}
+	
+	for (uint_fast32_t i = first_row; i < end_row; i++) {
+		ssim_sums_t window = { 0, 0, 0, 0, 0 };
+		
+		if (i > first_row) {
+			const uint8_t * restrict x_leave = &x[(i - 1) * line_stride];
+			const uint8_t * restrict y_leave = &y[(i - 1) * line_stride];
+			const uint8_t * restrict x_enter = &x[(i + BLOCK_HEIGHT - 1) * line_stride];
+			const uint8_t * restrict y_enter = &y[(i + BLOCK_HEIGHT - 1) * line_stride];
+			for (uint_fast32_t j = 0; j < width; j++) {
+				sums_sub_pixel(&column[j], x_leave[j * PIXEL_STRIDE], y_leave[j * PIXEL_STRIDE]);
+				sums_add_pixel(&column[j], x_enter[j * PIXEL_STRIDE], y_enter[j * PIXEL_STRIDE]);
+			}
+		}
+		
+		for (uint_fast32_t j = 0; j < BLOCK_WIDTH; j++) {
+			window.x  += column[j].x;
+			window.y  += column[j].y;
+			window.xx += column[j].xx;
+			window.yy += column[j].yy;
+			window.xy += column[j].xy;
+		}
+		for (uint_fast32_t j = 0; j < width - BLOCK_WIDTH; j++) {
+			if (j > 0) {
+				/* unsigned wrap-around cancels out, the result is always exact */
+				window.x  += column[j + BLOCK_WIDTH - 1].x  - column[j - 1].x;
+				window.y  += column[j + BLOCK_WIDTH - 1].y  - column[j - 1].y;
+				window.xx += column[j + BLOCK_WIDTH - 1].xx - column[j - 1].xx;
+				window.yy += column[j + BLOCK_WIDTH - 1].yy - column[j - 1].yy;
+				window.xy += column[j + BLOCK_WIDTH - 1].xy - column[j - 1].xy;
+			}
+			const double ssim = 1 - ssim_from_sums(window.x, window.y, window.xx, window.yy, window.xy);
+			map_store(map, hist, ssim, i, j, width, line_stride);
+		}
+	}
+}
+
 void ssim_map(const uint8_t * restrict x, const uint8_t * restrict y,
 			  uint8_t * restrict map, float * restrict hist,
 			  const unsigned width, const unsigned height, const unsigned line_stride)
 {
+	if (height <= BLOCK_HEIGHT || width <= BLOCK_WIDTH) return;
+	
+	/* bands of rows are independent, each one primes its own column sums */
+	const uint_fast32_t rows = height - BLOCK_HEIGHT;
+	const uint_fast32_t bands = (rows + MAP_BAND_HEIGHT - 1) / MAP_BAND_HEIGHT;
+	ssim_sums_t *column = malloc(bands * width * sizeof(ssim_sums_t));
+	if (!column) {
+		fprintf(stderr, "could not allocate SSIM column sums\n");
+		abort();
+	}
+	
 #pragma omp parallel for
-	for (uint_fast32_t i = 0; i < height - BLOCK_HEIGHT; i++) {
-		for (uint_fast32_t j = 0; j < width - BLOCK_WIDTH; j++) {
-			double ssim = 1 - ssim_block(&x[i * line_stride + j * PIXEL_STRIDE],
-										 &y[i * line_stride + j * PIXEL_STRIDE],
-										 line_stride, line_stride);
-			if (hist)
-				hist[(i + (BLOCK_HEIGHT / 2)) * width + (j + (BLOCK_WIDTH / 2)) * PIXEL_STRIDE] += ssim;
-			if (ssim <= 0.0)
-				map[(i + (BLOCK_HEIGHT / 2)) * line_stride + (j + (BLOCK_WIDTH / 2)) * PIXEL_STRIDE] = 0;
-			else if (ssim >= 1.0)
-				map[(i + (BLOCK_HEIGHT / 2)) * line_stride + (j + (BLOCK_WIDTH / 2)) * PIXEL_STRIDE] = 255;
-			else
-				map[(i + (BLOCK_HEIGHT / 2)) * line_stride + (j + (BLOCK_WIDTH / 2)) * PIXEL_STRIDE] = (uint8_t)(255 * ssim);
+	for (uint_fast32_t band = 0; band < bands; band++) {
+		const uint_fast32_t first_row = band * MAP_BAND_HEIGHT;
+		const uint_fast32_t end_row = (first_row + MAP_BAND_HEIGHT < rows) ? first_row + MAP_BAND_HEIGHT : rows;
+		ssim_map_band(x, y, map, hist, &column[band * width], width, line_stride, first_row, end_row);
+	}
+	
+	free(column);
+}
+
+#pragma mark -
+
+
+#pragma mark Quality Loss
+
+/* one plane's share of the quality loss, window positions are restricted to the rect */
+typedef struct {
+	const uint8_t *x, *y;
+	uint_fast32_t line_stride_x, line_stride_y;
+	uint_fast32_t min_i, end_i, min_j, end_j;
+	double weight;
+	unsigned subsampling;
+} quality_plane_t;
+
+struct ssim_pyramid_s {
+	picture_t x, y;
+	float precision;
+	uint64_t seed;
+	/* reduced resolution copies of both pictures, index l is reduced by 2^(l+1) */
+	unsigned levels;
+	picture_t reduced_x[PYRAMID_LEVELS], reduced_y[PYRAMID_LEVELS];
+	uint8_t *reduced;
+	size_t reduced_size;
+};
+
+static inline uint_fast32_t window_range_start(const uint_fast32_t rect_min, const uint_fast32_t block, const unsigned subsampling)
+{
+	/* all windows overlapping the rect */
+	return ((rect_min >> subsampling) + 1 > block) ? (rect_min >> subsampling) + 1 - block : 0;
+}
+
+static inline uint_fast32_t window_range_end(const uint_fast32_t rect_max, const uint_fast32_t size, const uint_fast32_t block, const unsigned subsampling)
+{
+	/* subsampled planes historically include the window at the rect's max coordinate */
+	const uint_fast32_t end = (rect_max >> subsampling) + subsampling;
+	const uint_fast32_t positions = (size > block) ? size - block : 0;
+	return (end < positions) ? end : positions;
+}
+
+static quality_plane_t quality_plane(const uint8_t *x, const uint8_t *y,
+									 const uint_fast32_t line_stride_x, const uint_fast32_t line_stride_y,
+									 const uint_fast32_t width, const uint_fast32_t height,
+									 const change_rect_t * restrict rect, const unsigned subsampling, const double weight)
+{
+	const change_rect_t full = { 0, 0, width, height };
+	if (!rect) rect = &full;
+	
+	return (quality_plane_t){
+		.x = x, .y = y,
+		.line_stride_x = line_stride_x, .line_stride_y = line_stride_y,
+		.min_i = window_range_start(rect->min_y, BLOCK_HEIGHT, subsampling),
+		.end_i = window_range_end(rect->max_y, height >> subsampling, BLOCK_HEIGHT, subsampling),
+		.min_j = window_range_start(rect->min_x, BLOCK_WIDTH, subsampling),
+		.end_j = window_range_end(rect->max_x, width >> subsampling, BLOCK_WIDTH, subsampling),
+		.weight = weight, .subsampling = subsampling
+	};
+}
+
+static inline uint_fast32_t quality_plane_bands(const quality_plane_t *plane)
+{
+	if (plane->end_i <= plane->min_i || plane->end_j <= plane->min_j) return 0;
+	return (plane->end_i - plane->min_i + QUALITY_BAND_HEIGHT - 1) / QUALITY_BAND_HEIGHT;
+}
+
+/* counter-based PRNG: every random number is a pure function of a key and a counter,
+ * so sample positions do not depend on the order in which they are visited */
+static inline uint64_t prng_mix(uint64_t z)
+{
+	/* splitmix64 finalizer */
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static inline uint64_t prng_counter(const uint64_t key, const uint64_t counter)
+{
+	return prng_mix(key + prng_mix(counter + 0x9E3779B97F4A7C15ULL));
+}
+
+/* the window at row i, column j of a plane as it looks when only the blocks of one bin
+ * have changed: pixels of y within the blocks of that bin, pixels of x elsewhere */
+static void bin_window(const quality_plane_t * restrict plane, const ssim_bins_t * restrict bins, const unsigned bin,
+					   const uint_fast32_t i, const uint_fast32_t j, uint8_t window[N])
+{
+	for (uint_fast32_t row = 0; row < BLOCK_HEIGHT; row++) {
+		const uint16_t *bin_line = &bins->map[(((i + row) << plane->subsampling) >> bins->block_size_log) * bins->line_stride];
+		const uint8_t *x_line = &plane->x[(i + row) * plane->line_stride_x];
+		const uint8_t *y_line = &plane->y[(i + row) * plane->line_stride_y];
+		for (uint_fast32_t column = 0; column < BLOCK_WIDTH; column++) {
+			const uint_fast32_t pixel = (j + column) * PIXEL_STRIDE;
+			const bool changed = (bin_line[((j + column) << plane->subsampling) >> bins->block_size_log] == bin);
+			window[row * BLOCK_WIDTH + column] = changed ? y_line[pixel] : x_line[pixel];
+		}
+	}
+}
+
+/* accumulates the loss of one window into the bins of the blocks it overlaps */
+static void bin_loss(const quality_plane_t * restrict plane, const ssim_bins_t * restrict bins,
+					 const uint_fast32_t i, const uint_fast32_t j, double * restrict sum)
+{
+	/* a window overlaps at most 2x2 blocks */
+	const uint_fast32_t top    = (i << plane->subsampling) >> bins->block_size_log;
+	const uint_fast32_t bottom = ((i + BLOCK_HEIGHT - 1) << plane->subsampling) >> bins->block_size_log;
+	const uint_fast32_t left   = (j << plane->subsampling) >> bins->block_size_log;
+	const uint_fast32_t right  = ((j + BLOCK_WIDTH - 1) << plane->subsampling) >> bins->block_size_log;
+	const unsigned block_bin[4] = {
+		bins->map[top * bins->line_stride + left], bins->map[top * bins->line_stride + right],
+		bins->map[bottom * bins->line_stride + left], bins->map[bottom * bins->line_stride + right]
+	};
+	
+	if (block_bin[0] == block_bin[1] && block_bin[0] == block_bin[2] && block_bin[0] == block_bin[3]) {
+		/* the common case: the window lies within the blocks of a single bin */
+		if (block_bin[0] >= bins->count) return;
+		sum[block_bin[0]] += plane->weight * (1.0 - ssim_block(&plane->x[i * plane->line_stride_x + j * PIXEL_STRIDE], &plane->y[i * plane->line_stride_y + j * PIXEL_STRIDE], plane->line_stride_x, plane->line_stride_y));
+		return;
+	}
+	
+	/* windows straddling bins count towards each of them, but only see that bin's changes */
+	for (unsigned b = 0; b < 4; b++) {
+		if (block_bin[b] >= bins->count) continue;
+		if ((b > 0 && block_bin[b] == block_bin[0]) || (b > 1 && block_bin[b] == block_bin[1]) || (b > 2 && block_bin[b] == block_bin[2])) continue;
+		uint8_t window[N];
+		bin_window(plane, bins, block_bin[b], i, j, window);
+		sum[block_bin[b]] += plane->weight * (1.0 - ssim_block(&plane->x[i * plane->line_stride_x + j * PIXEL_STRIDE], window, plane->line_stride_x, BLOCK_WIDTH));
+	}
+}
+
+/* Stratified sampling: each row of window positions is cut into strata of 1/precision
+ * positions and every stratum contributes the one position its random number points to.
+ * Every window position is sampled with probability precision, but only sampled positions
+ * are ever visited, so the cost is proportional to precision times area. */
+static void quality_loss_band(const quality_plane_t * restrict plane, const ssim_bins_t * restrict bins,
+							  const uint_fast32_t first_i, const uint_fast32_t end_i,
+							  const uint64_t key, const double stratum, double * restrict sum)
+{
+	for (uint_fast32_t i = first_i; i < end_i; i++) {
+		for (uint64_t k = (uint64_t)(plane->min_j / stratum); (double)k * stratum < plane->end_j; k++) {
+			const uint64_t sample_seed = prng_counter(key, ((uint64_t)i << 32) | k);
+			/* uniform in [0,1) with 53 bits */
+			const double offset = (double)(sample_seed >> 11) * (1.0 / (UINT64_C(1) << 53));
+			const uint_fast32_t j = (uint_fast32_t)(((double)k + offset) * stratum);
+			if (j < plane->min_j || j >= plane->end_j) continue;
+			if (bins) {
+				bin_loss(plane, bins, i, j, sum);
+				continue;
+			}
+			const double loss = 1.0 - ssim_block(&plane->x[i * plane->line_stride_x + j * PIXEL_STRIDE], &plane->y[i * plane->line_stride_y + j * PIXEL_STRIDE], plane->line_stride_x, plane->line_stride_y);
+			sum[0] += plane->weight * loss;
 		}
 	}
 }
 
+static void quality_planes(quality_plane_t plane[3], const picture_t * restrict x, const picture_t * restrict y,
+						   const change_rect_t * restrict rect)
+{
+	/* due to subsampling, one chroma window is worth 4 luma windows, hence the factor 4 */
+	plane[0] = quality_plane(x->Y,  y->Y,  x->line_stride_Y,  y->line_stride_Y,  x->width, x->height, rect, 0, WEIGHT_Y);
+	plane[1] = quality_plane(x->Cb, y->Cb, x->line_stride_Cb, y->line_stride_Cb, x->width, x->height, rect, 1, 4 * WEIGHT_CB);
+	plane[2] = quality_plane(x->Cr, y->Cr, x->line_stride_Cr, y->line_stride_Cr, x->width, x->height, rect, 1, 4 * WEIGHT_CR);
+}
+
+/* the quality loss within rect, split into bins->count values when binning, otherwise a single value */
+static void quality_loss(const picture_t * restrict x, const picture_t * restrict y,
+						 const change_rect_t * restrict rect, const float precision,
+						 const uint64_t seed, const ssim_bins_t * restrict bins, float * restrict loss)
+{
+	const double stratum = (precision < 1.0f) ? 1.0 / precision : 1.0;
+	const uint_fast32_t count = bins ? bins->count : 1;
+	
+	pthread_once(&kernel_chosen, kernel_init);
+	
+	for (uint_fast32_t bin = 0; bin < count; bin++)
+		loss[bin] = 0.0f;
+	
+	quality_plane_t plane[3];
+	quality_planes(plane, x, y, rect);
+	
+	/* the planes are cut into bands of rows, which are the tiles of parallel work */
+	uint_fast32_t first_tile[4] = { 0 };
+	for (uint_fast32_t p = 0; p < 3; p++)
+		first_tile[p + 1] = first_tile[p] + quality_plane_bands(&plane[p]);
+	const uint_fast32_t tiles = first_tile[3];
+	if (!tiles || !count) return;
+	
+	double *partial = calloc(tiles * count, sizeof(double));
+	if (!partial) {
+		fprintf(stderr, "could not allocate SSIM partial sums\n");
+		abort();
+	}
+	
+#pragma omp parallel for schedule(dynamic) if (tiles > 1)
+	for (uint_fast32_t tile = 0; tile < tiles; tile++) {
+		const uint_fast32_t p = (tile >= first_tile[2]) ? 2 : ((tile >= first_tile[1]) ? 1 : 0);
+		const uint_fast32_t first_i = plane[p].min_i + (tile - first_tile[p]) * QUALITY_BAND_HEIGHT;
+		const uint_fast32_t end_i = (first_i + QUALITY_BAND_HEIGHT < plane[p].end_i) ? first_i + QUALITY_BAND_HEIGHT : plane[p].end_i;
+		quality_loss_band(&plane[p], bins, first_i, end_i, prng_counter(seed, p), stratum, &partial[tile * count]);
+	}
+	
+	/* sum up in a fixed order, so the result does not depend on the number of threads */
+	for (uint_fast32_t bin = 0; bin < count; bin++) {
+		double ssim = 0.0;
+		for (uint_fast32_t tile = 0; tile < tiles; tile++)
+			ssim += partial[tile * count + bin];
+		loss[bin] = (float)(ssim / (x->width * x->height * precision));
+	}
+	free(partial);
+}
+
 float ssim_quality_loss(const picture_t * restrict x, const picture_t * restrict y,
-						const change_rect_t * restrict rect, const float precision)
-{
-	double ssim = 0.0;
-	
-	/* note: random() is not thread-safe, meaning that concurrent use could mess up
-	 * internal state and your random numbers are no longer random. Gotta love POSIX. */
-	unsigned short prng_state[3][3];
-	static const unsigned long nrand48_max = (1UL << 31) - 1;
-	
-	for (uint_fast32_t i = 0; i < 3; i++)
-		for (uint_fast32_t j = 0; j < 3; j++)
-			prng_state[i][j] = (unsigned short)random();
-
-	/* TODO: limited to a parallelism of only 3 threads */
-#pragma omp parallel sections reduction(+: ssim)
-	{
-		/* Y */
-#pragma omp section
-		for (uint_fast32_t i = 0; i < x->height - BLOCK_HEIGHT; i++)
-			if (!rect || (i + BLOCK_HEIGHT > rect->min_y && i < rect->max_y))
-				for (uint_fast32_t j = 0; j < x->width - BLOCK_WIDTH; j++)
-					if (!rect || (j + BLOCK_WIDTH  > rect->min_x && j < rect->max_x))
-						if (nrand48(prng_state[0]) < precision * nrand48_max)
-							ssim += WEIGHT_Y * (1.0 - ssim_block(&x->Y[i * x->line_stride_Y + j * PIXEL_STRIDE], &y->Y[i * y->line_stride_Y + j * PIXEL_STRIDE], x->line_stride_Y, y->line_stride_Y));
-		
-#pragma omp section
-		/* Cb */
-		for (uint_fast32_t i = 0; i < x->height / 2 - BLOCK_HEIGHT; i++)
-			if (!rect || (i + BLOCK_HEIGHT > rect->min_y / 2 && i <= rect->max_y / 2))
-				for (uint_fast32_t j = 0; j < x->width / 2 - BLOCK_WIDTH; j++)
-					if (!rect || (j + BLOCK_WIDTH > rect->min_x / 2 && j <= rect->max_x / 2))
-						if (nrand48(prng_state[1]) < precision * nrand48_max)
-							/* due to subsampling, one chroma window is worth 4 luma windows, hence the factor 4 */
-							ssim += 4 * WEIGHT_CB * (1.0 - ssim_block(&x->Cb[i * x->line_stride_Cb + j * PIXEL_STRIDE], &y->Cb[i * y->line_stride_Cb + j * PIXEL_STRIDE], x->line_stride_Cb, y->line_stride_Cb));
+						const change_rect_t * restrict rect, const float precision, const uint64_t seed)
+{
+	float loss;
+	quality_loss(x, y, rect, precision, prng_mix(seed), NULL, &loss);
+	return loss;
+}
+
+void ssim_quality_loss_binned(const picture_t * restrict x, const picture_t * restrict y,
+							  const ssim_bins_t * restrict bins, const float precision, const uint64_t seed, float * restrict loss)
+{
+	quality_loss(x, y, NULL, precision, prng_mix(seed), bins, loss);
+}
+
+#pragma mark -
+
+
+#pragma mark Reduced Resolution Pyramid
+
+static void reduce_plane(const uint8_t * restrict src, const uint_fast32_t src_stride,
+						 uint8_t * restrict dst, const uint_fast32_t dst_stride,
+						 const uint_fast32_t min_x, const uint_fast32_t min_y,
+						 const uint_fast32_t max_x, const uint_fast32_t max_y)
+{
+	for (uint_fast32_t i = min_y; i < max_y; i++) {
+		const uint8_t *line0 = &src[2 * i * src_stride];
+		const uint8_t *line1 = line0 + src_stride;
+		for (uint_fast32_t j = min_x; j < max_x; j++)
+			dst[i * dst_stride + j] = (uint8_t)((line0[2*j] + line0[2*j+1] + line1[2*j] + line1[2*j+1] + 2) >> 2);
+	}
+}
+
+/* updates pyramid level l of a picture from the next finer one within rect,
+ * which is given in full resolution luma coordinates */
+static void reduce_picture(const picture_t * restrict src, const picture_t * restrict dst,
+						   const change_rect_t * restrict rect, const unsigned level)
+{
+	const change_rect_t full = { 0, 0, (uint_fast32_t)dst->width << (level + 1), (uint_fast32_t)dst->height << (level + 1) };
+	if (!rect) rect = &full;
+	
+	for (unsigned p = 0; p < 3; p++) {
+		const unsigned shift = level + 1 + (p ? 1 : 0);
+		const uint_fast32_t width  = p ? dst->width  >> 1 : dst->width;
+		const uint_fast32_t height = p ? dst->height >> 1 : dst->height;
+		const uint_fast32_t max_x = (rect->max_x + (1U << shift) - 1) >> shift;
+		const uint_fast32_t max_y = (rect->max_y + (1U << shift) - 1) >> shift;
+		const uint8_t *src_plane = (p == 0) ? src->Y : ((p == 1) ? src->Cb : src->Cr);
+		uint8_t *dst_plane = (p == 0) ? dst->Y : ((p == 1) ? dst->Cb : dst->Cr);
+		const uint_fast32_t src_stride = (p == 0) ? src->line_stride_Y : ((p == 1) ? src->line_stride_Cb : src->line_stride_Cr);
+		const uint_fast32_t dst_stride = (p == 0) ? dst->line_stride_Y : ((p == 1) ? dst->line_stride_Cb : dst->line_stride_Cr);
+		reduce_plane(src_plane, src_stride, dst_plane, dst_stride,
+					 rect->min_x >> shift, rect->min_y >> shift,
+					 (max_x < width) ? max_x : width, (max_y < height) ? max_y : height);
+	}
+}
+
+/* lays out the reduced pictures in one buffer and builds them from scratch */
+static void pyramid_build(ssim_pyramid_t *pyramid)
+{
+	size_t size = 0;
+	
+	for (unsigned l = 0; l < pyramid->levels; l++) {
+		const uint_fast32_t width  = pyramid->x.width  >> (l + 1);
+		const uint_fast32_t height = pyramid->x.height >> (l + 1);
+		size += 2 * (width * height + 2 * (width >> 1) * (height >> 1));
+	}
+	if (size > pyramid->reduced_size) {
+		free(pyramid->reduced);
+		pyramid->reduced = malloc(size);
+		pyramid->reduced_size = pyramid->reduced ? size : 0;
+		if (!pyramid->reduced) {
+			fprintf(stderr, "could not allocate SSIM pyramid\n");
+			abort();
+		}
+	}
+	
+	uint8_t *buffer = pyramid->reduced;
+	for (unsigned l = 0; l < pyramid->levels; l++) {
+		picture_t *reduced[2] = { &pyramid->reduced_x[l], &pyramid->reduced_y[l] };
+		for (unsigned k = 0; k < 2; k++) {
+			reduced[k]->width  = pyramid->x.width  >> (l + 1);
+			reduced[k]->height = pyramid->x.height >> (l + 1);
+			reduced[k]->line_stride_Y  = reduced[k]->width;
+			reduced[k]->line_stride_Cb = reduced[k]->line_stride_Cr = reduced[k]->width >> 1;
+			reduced[k]->Y  = buffer;
+			buffer += reduced[k]->width * reduced[k]->height;
+			reduced[k]->Cb = buffer;
+			buffer += (reduced[k]->width >> 1) * (reduced[k]->height >> 1);
+			reduced[k]->Cr = buffer;
+			buffer += (reduced[k]->width >> 1) * (reduced[k]->height >> 1);
+		}
+		reduce_picture(l ? &pyramid->reduced_x[l - 1] : &pyramid->x, &pyramid->reduced_x[l], NULL, l);
+		reduce_picture(l ? &pyramid->reduced_y[l - 1] : &pyramid->y, &pyramid->reduced_y[l], NULL, l);
+	}
+}
+
+ssim_pyramid_t *ssim_pyramid_alloc(const unsigned levels)
+{
+	ssim_pyramid_t *pyramid = malloc(sizeof(ssim_pyramid_t));
+	if (!pyramid) return NULL;
+	
+	pyramid->levels = (levels < PYRAMID_LEVELS) ? levels : PYRAMID_LEVELS;
+	pyramid->reduced = NULL;
+	pyramid->reduced_size = 0;
+	return pyramid;
+}
+
+void ssim_pyramid_reset(ssim_pyramid_t *pyramid, const picture_t *x, const picture_t *y, const float precision, const uint64_t seed)
+{
+	pyramid->x = *x;
+	pyramid->y = *y;
+	pyramid->precision = precision;
+	pyramid->seed = prng_mix(seed);
+	pyramid_build(pyramid);
+}
+
+void ssim_pyramid_update(ssim_pyramid_t *pyramid, const change_rect_t *rect)
+{
+	/* the reduced pictures are updated eagerly, this is cheap compared to SSIM */
+	for (unsigned l = 0; l < pyramid->levels; l++)
+		reduce_picture(l ? &pyramid->reduced_y[l - 1] : &pyramid->y, &pyramid->reduced_y[l], rect, l);
+}
+
+float ssim_pyramid_quality_loss(ssim_pyramid_t *pyramid, const change_rect_t *rect, const unsigned level)
+{
+	float loss;
+	
+	if (level == 0 || level > pyramid->levels) {
+		quality_loss(&pyramid->x, &pyramid->y, rect, pyramid->precision, pyramid->seed, NULL, &loss);
+		return loss;
+	}
+	
+	const change_rect_t reduced = rect ? (change_rect_t){
+		.min_x = rect->min_x >> level, .min_y = rect->min_y >> level,
+		.max_x = (rect->max_x + (1U << level) - 1) >> level,
+		.max_y = (rect->max_y + (1U << level) - 1) >> level
+	} : (change_rect_t){ 0, 0, 0, 0 };
+	/* sampling more densely offsets some of the variance of the fewer window positions */
+	const float precision = (pyramid->precision * (1 << level) < 1.0f) ? pyramid->precision * (1 << level) : 1.0f;
+	
+	/* both pictures use the same sample positions for a level until the next reset */
+	quality_loss(&pyramid->reduced_x[level - 1], &pyramid->reduced_y[level - 1], rect ? &reduced : NULL,
+				 precision, prng_counter(pyramid->seed, level), NULL, &loss);
+	return loss;
+}
+
+void ssim_pyramid_free(ssim_pyramid_t *pyramid)
+{
+	if (!pyramid) return;
+	free(pyramid->reduced);
+	free(pyramid);
+}
+
+#pragma mark -
+
+
+#pragma mark Sequential Comparison
+
+/* copies the window at row i, column j of a patchwork's plane p into a compact buffer */
+static void patchwork_window(const ssim_patchwork_t * restrict work, const unsigned p,
+							 const uint_fast32_t i, const uint_fast32_t j, uint8_t window[N])
+{
+	const unsigned subsampling = p ? 1 : 0;
+	/* block edge length in pixels of this plane */
+	const unsigned block_log = work->block_size_log - subsampling;
+	
+	for (uint_fast32_t row = 0; row < BLOCK_HEIGHT; row++) {
+		const uint_fast32_t y = i + row;
+		const ssim_patch_t *line = &work->patch[(y >> block_log) * work->line_stride];
+		/* a window spans at most two blocks horizontally, copy the runs within each */
+		for (uint_fast32_t column = 0; column < BLOCK_WIDTH;) {
+			const uint_fast32_t x = j + column;
+			const ssim_patch_t *patch = &line[x >> block_log];
+			const uint_fast32_t block_end = ((x >> block_log) + 1) << block_log;
+			const uint_fast32_t run = (block_end - x < BLOCK_WIDTH - column) ? block_end - x : BLOCK_WIDTH - column;
+			if (patch->source) {
+				const uint8_t *plane = (p == 0) ? patch->source->Y : ((p == 1) ? patch->source->Cb : patch->source->Cr);
+				const uint_fast32_t stride = (p == 0) ? patch->source->line_stride_Y : ((p == 1) ? patch->source->line_stride_Cb : patch->source->line_stride_Cr);
+				const int dx = patch->dx >> subsampling;
+				const int dy = patch->dy >> subsampling;
+				memcpy(&window[row * BLOCK_WIDTH + column], &plane[(size_t)((int)y + dy) * stride + (size_t)((int)x + dx)], run);
+			} else {
+				memset(&window[row * BLOCK_WIDTH + column], patch->constant[p], run);
+			}
+			column += run;
+		}
+	}
+}
+
+/* SSIM of one window of a comparison variant, which is either a picture or a patchwork */
+static inline double variant_ssim(const quality_plane_t * restrict plane, const ssim_patchwork_t * restrict work,
+								  const unsigned p, const uint_fast32_t i, const uint_fast32_t j)
+{
+	if (!work)
+		return ssim_block(&plane->x[i * plane->line_stride_x + j * PIXEL_STRIDE], &plane->y[i * plane->line_stride_y + j * PIXEL_STRIDE], plane->line_stride_x, plane->line_stride_y);
+	
+	uint8_t window[N];
+	patchwork_window(work, p, i, j, window);
+	return ssim_block(&plane->x[i * plane->line_stride_x + j * PIXEL_STRIDE], window, plane->line_stride_x, BLOCK_WIDTH);
+}
+
+static bool compare(const picture_t * restrict x, const picture_t * restrict y1, const picture_t * restrict y2,
+					const ssim_patchwork_t * restrict work1, const ssim_patchwork_t * restrict work2,
+					const change_rect_t * restrict rect, const float threshold, const float precision, const uint64_t seed)
+{
+	quality_plane_t plane1[3], plane2[3];
+	uint64_t first_position[4] = { 0 };
+	double sum = 0.0, sum_squares = 0.0;
+	uint64_t samples;
+	
+	pthread_once(&kernel_chosen, kernel_init);
+	
+	quality_planes(plane1, x, y1, rect);
+	quality_planes(plane2, x, y2, rect);
+	for (uint_fast32_t p = 0; p < 3; p++) {
+		const uint64_t rows = (plane1[p].end_i > plane1[p].min_i) ? plane1[p].end_i - plane1[p].min_i : 0;
+		const uint64_t columns = (plane1[p].end_j > plane1[p].min_j) ? plane1[p].end_j - plane1[p].min_j : 0;
+		first_position[p + 1] = first_position[p] + rows * columns;
+	}
+	const uint64_t positions = first_position[3];
+	if (!positions) return (0.0f <= threshold);
+	
+	/* the mean difference of one window scales to the difference of quality loss values like this */
+	const double scale = (double)positions / (x->width * x->height);
+	/* the sample budget grows with the rect, like the fixed precision calculation */
+	const uint64_t limit = ((double)positions * precision > COMPARE_MIN_SAMPLES) ?
+		(uint64_t)ceil((double)positions * precision) : COMPARE_MIN_SAMPLES;
+	const uint64_t key = prng_mix(seed);
+	
+	/* windows are drawn uniformly from all positions overlapping the rect; since both variants
+	 * are evaluated on the same windows, the differences have little variance */
+	for (samples = 0; samples < limit;) {
+		const uint64_t position = prng_counter(key, samples) % positions;
+		const unsigned p = (position >= first_position[2]) ? 2 : ((position >= first_position[1]) ? 1 : 0);
+		const uint64_t offset = position - first_position[p];
+		const uint64_t columns = plane1[p].end_j - plane1[p].min_j;
+		const uint_fast32_t i = plane1[p].min_i + (uint_fast32_t)(offset / columns);
+		const uint_fast32_t j = plane1[p].min_j + (uint_fast32_t)(offset % columns);
+		/* the loss of variant 2 minus the loss of variant 1 */
+		const double difference = plane1[p].weight * (variant_ssim(&plane1[p], work1, p, i, j) - variant_ssim(&plane2[p], work2, p, i, j));
+		sum += difference;
+		sum_squares += difference * difference;
+		samples++;
 		
-#pragma omp section
-		/* Cr */
-		for (uint_fast32_t i = 0; i < x->height / 2 - BLOCK_HEIGHT; i++)
-			if (!rect || (i + BLOCK_HEIGHT > rect->min_y / 2 && i <= rect->max_y / 2))
-				for (uint_fast32_t j = 0; j < x->width / 2 - BLOCK_WIDTH; j++)
-					if (!rect || (j + BLOCK_WIDTH > rect->min_x / 2 && j <= rect->max_x / 2))
-						if (nrand48(prng_state[2]) < precision * nrand48_max)
-							/* due to subsampling, one chroma window is worth 4 luma windows, hence the factor 4 */
-							ssim += 4 * WEIGHT_CR * (1.0 - ssim_block(&x->Cr[i * x->line_stride_Cr + j * PIXEL_STRIDE], &y->Cr[i * y->line_stride_Cr + j * PIXEL_STRIDE], x->line_stride_Cr, y->line_stride_Cr));
-	}
-	
-	return (float)(ssim / (x->width * x->height * precision));
+		if (samples >= COMPARE_MIN_SAMPLES && samples % COMPARE_BATCH == 0) {
+			/* stop as soon as the confidence interval lies on one side of the threshold */
+			const double mean = sum / samples;
+			const double variance = (sum_squares - sum * mean) / (samples - 1);
+			const double half_width = COMPARE_Z * sqrt((variance > 0.0 ? variance : 0.0) / samples);
+			if ((mean + half_width) * scale <= threshold) return true;
+			if ((mean - half_width) * scale > threshold) return false;
+		}
+	}
+	
+	return (sum / samples * scale <= threshold);
+}
+
+bool ssim_quality_loss_compare(const picture_t * restrict x, const picture_t * restrict y1, const picture_t * restrict y2,
+							   const change_rect_t * restrict rect, const float threshold, const float precision, const uint64_t seed)
+{
+	return compare(x, y1, y2, NULL, NULL, rect, threshold, precision, seed);
+}
+
+bool ssim_patchwork_compare(const picture_t * restrict x, const ssim_patchwork_t * restrict y1, const ssim_patchwork_t * restrict y2,
+							const change_rect_t * restrict rect, const float threshold, const float precision, const uint64_t seed)
+{
+	/* the planes only provide window ranges and weights, the pixels come from the patchworks */
+	return compare(x, x, x, y1, y2, rect, threshold, precision, seed);
 }
@@ -4,6 +4,7 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef struct {
 	/* rectangle around the area of change, min inclusive, max exclusive */
@@ -33,6 +34,86 @@ void ssim_map(const uint8_t * restrict x, const uint8_t * restrict y,
 			  uint8_t * restrict map, float * restrict hist,
 			  const unsigned width, const unsigned height, const unsigned line_stride);
 
-/* calculates an aggregated quality loss value within given rectangle and with given precision */
+/* calculates an aggregated quality loss value within given rectangle and with given precision,
+ * which is the fraction of window positions sampled; cost is proportional to precision times area;
+ * the sampled positions are a function of seed only, the library keeps no random state */
 float ssim_quality_loss(const picture_t * restrict x, const picture_t * restrict y,
-						const change_rect_t * restrict rect, const float precision);
+						const change_rect_t * restrict rect, const float precision, uint64_t seed);
+
+typedef struct {
+	/* one bin number per block, blocks have an edge length of 1 << block_size_log luma pixels */
+	const uint16_t *map;
+	uint_fast32_t line_stride;
+	unsigned block_size_log;
+	/* number of bins, windows in blocks with higher bin numbers are ignored */
+	unsigned count;
+} ssim_bins_t;
+
+/* quality loss of the entire picture in one pass, but accumulated per bin into loss[];
+ * each window counts towards every bin of the blocks it overlaps, with y showing through
+ * only within the blocks of that bin, as if just this bin had changed */
+void ssim_quality_loss_binned(const picture_t * restrict x, const picture_t * restrict y,
+							  const ssim_bins_t * restrict bins, float precision, uint64_t seed, float * restrict loss);
+
+/* A pyramid keeps both pictures reduced by 2x, 4x, ... to estimate the quality loss
+ * of large areas cheaply. The estimates are biased compared to full resolution, since
+ * downsampling blurs away some of the error. The pictures are referenced, not copied,
+ * the caller must report all changes to y. */
+typedef struct ssim_pyramid_s ssim_pyramid_t;
+
+/* number of reduced levels to keep, at most 2 */
+ssim_pyramid_t *ssim_pyramid_alloc(unsigned levels);
+/* binds the pyramid to new pictures, a precision and the seed of its samplings and builds the reduced levels */
+void ssim_pyramid_reset(ssim_pyramid_t *pyramid, const picture_t *x, const picture_t *y, float precision, uint64_t seed);
+/* pixels of y within rect have changed, NULL updates everything */
+void ssim_pyramid_update(ssim_pyramid_t *pyramid, const change_rect_t *rect);
+/* quality loss within rect estimated on the pictures reduced by 2^level,
+ * level 0 or levels not kept fall back to full resolution */
+float ssim_pyramid_quality_loss(ssim_pyramid_t *pyramid, const change_rect_t *rect, unsigned level);
+void ssim_pyramid_free(ssim_pyramid_t *pyramid);
+
+/* Compares two variants y1 and y2 of the picture x by checking whether the quality loss
+ * of y2 exceeds the one of y1 by more than threshold within rect. Window positions are
+ * sampled until a confidence interval around the difference settles the decision, so
+ * clear cases stop early; the sampling never exceeds the fraction given by precision.
+ * Returns true if the difference is within the threshold. */
+bool ssim_quality_loss_compare(const picture_t * restrict x, const picture_t * restrict y1, const picture_t * restrict y2,
+							   const change_rect_t * restrict rect, float threshold, float precision, uint64_t seed);
+
+/* A patchwork describes a picture assembled from square blocks of other pictures, just
+ * like replacement produces it, without materializing the pixels. Each block is read
+ * from its source at the block's own position plus a displacement, which must stay
+ * within the source. Blocks without source have a constant value per plane. */
+typedef struct {
+	const picture_t *source;
+	/* displacement in luma pixels, chroma uses half of it rounded down */
+	int dx, dy;
+	uint8_t constant[3];
+} ssim_patch_t;
+
+typedef struct {
+	/* one patch per block, blocks have an edge length of 1 << block_size_log luma pixels */
+	const ssim_patch_t *patch;
+	uint_fast32_t line_stride;
+	unsigned block_size_log;
+} ssim_patchwork_t;
+
+/* like ssim_quality_loss_compare(), but with the variants given as patchworks;
+ * the window pixels are gathered directly from the patch sources */
+bool ssim_patchwork_compare(const picture_t * restrict x, const ssim_patchwork_t * restrict y1, const ssim_patchwork_t * restrict y2,
+							const change_rect_t * restrict rect, float threshold, float precision, uint64_t seed);
+
+/* the SSIM window kernel is chosen at runtime according to the CPU's capabilities;
+ * the choice can be overridden, which is useful for benchmarking */
+typedef enum {
+	SSIM_KERNEL_AUTO,
+	SSIM_KERNEL_SCALAR,
+	SSIM_KERNEL_SSE41,
+	SSIM_KERNEL_AVX2
+} ssim_kernel_t;
+
+/* selects a kernel, returns false if the CPU does not support it;
+ * not to be called while other threads calculate SSIM */
+bool ssim_kernel_select(ssim_kernel_t kernel);
+/* the kernel currently in use */
+ssim_kernel_t ssim_kernel(void);
@@ -6,4 +6,5 @@
 #include "libavcodec/avcodec.h"
 
 void process_init(AVCodecContext *c, const char *file);
+void process_packet(AVCodecContext *c, const AVPacket *packet);
 void process_finish(AVCodecContext *c);
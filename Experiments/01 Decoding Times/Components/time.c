@@ -36,6 +36,12 @@ void process_init(AVCodecContext *c, const char *file)
 	c->process_slice = (void (*)(void *))measure_times;
 }
 
+void process_packet(AVCodecContext *c, const AVPacket *packet)
+{
+	(void)c;
+	(void)packet;
+}
+
 void process_finish(AVCodecContext *c)
 {
 	(void)c;
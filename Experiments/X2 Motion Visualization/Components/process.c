@@ -24,6 +24,10 @@ void process_init(AVCodecContext *c, const char *file)
 	c->process_metadata = NULL;
 }
 
+void process_packet(AVCodecContext *c, const AVPacket *packet)
+{
+}
+
 void process_finish(AVCodecContext *c)
 {
 }
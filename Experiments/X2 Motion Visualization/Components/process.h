@@ -10,4 +10,5 @@
 #undef fprintf
 
 void process_init(AVCodecContext *c, const char *file);
+void process_packet(AVCodecContext *c, const AVPacket *packet);
 void process_finish(AVCodecContext *c);
@@ -0,0 +1 @@
+../../../Components/arena.c
\ No newline at end of file
@@ -0,0 +1 @@
+../../../Components/arena.h
\ No newline at end of file
@@ -41,20 +41,20 @@ static void draw_slice_error(AVPicture *frame)
 {
 	int slice, mb, y, x;
 	
-	for (slice = 0; slice < proc.frame->slice_count; slice++) {
-		for (mb = proc.frame->slice[slice].start_index; mb < proc.frame->slice[slice].end_index; mb++) {
-			const int mb_x = mb % proc.mb_width;
-			const int mb_y = mb / proc.mb_width;
+	for (slice = 0; slice < proc->frame->slice_count; slice++) {
+		for (mb = proc->frame->slice[slice].start_index; mb < proc->frame->slice[slice].end_index; mb++) {
+			const int mb_x = mb % proc->mb_width;
+			const int mb_y = mb / proc->mb_width;
 			const byte_block_t error = byte_spread *
-			((5 * proc.frame->slice_count * proc.frame->slice[slice].direct_quality_loss < 1.0) ?
-			 (uint8_t)(0xFF * 5 * proc.frame->slice_count * proc.frame->slice[slice].direct_quality_loss) :
+			((5 * proc->frame->slice_count * proc->frame->slice[slice].direct_quality_loss < 1.0) ?
+			 (uint8_t)(0xFF * 5 * proc->frame->slice_count * proc->frame->slice[slice].direct_quality_loss) :
 			 0xFF);
 			int start_x = mb_x << mb_size_log;
 			int start_y = mb_y << mb_size_log;
 			int end_x = (mb_x + 1) << mb_size_log;
 			int end_y = (mb_y + 1) << mb_size_log;
 			/* Y */
-			if (proc.frame->replacement)
+			if (proc->frame->replacement)
 				for (y = start_y; y < end_y; y++)
 					for (x = start_x; x < end_x; x += sizeof(byte_block_t))
 						BLOCK(frame->data[0], x + y * frame->linesize[0]) = error;
@@ -77,7 +77,7 @@ static void draw_slice_error(AVPicture *frame)
 		}
 		
 		/* write slice number onto the image */
-		print_number(frame, proc.frame->slice[slice].start_index, proc.frame->slice[slice].end_index);
+		print_number(frame, proc->frame->slice[slice].start_index, proc->frame->slice[slice].end_index);
 	}
 }
 
@@ -119,7 +119,7 @@ void hook_slice_end(const AVCodecContext *c)
 		quad.data[0] += c->width;
 		quad.data[1] += c->width / 2;
 		quad.data[2] += c->width / 2;
-		do_replacement(c, &quad, SLICE_MAX, NULL);
+		do_replacement(c, &quad, SLICE_FRAME, NULL);
 		/* left lower quadrant: slice error map */
 		quad.data[0] += (c->height    ) * quad.linesize[0] - (c->width    );
 		quad.data[1] += (c->height / 2) * quad.linesize[1] - (c->width / 2);
@@ -129,8 +129,8 @@ void hook_slice_end(const AVCodecContext *c)
 		quad.data[0] += c->width;
 		quad.data[1] += c->width / 2;
 		quad.data[2] += c->width / 2;
-		do_replacement(c, &quad, SLICE_MAX, NULL);
-		draw_border(proc.frame->replacement, &quad);
+		do_replacement(c, &quad, SLICE_FRAME, NULL);
+		draw_border(proc->frame->replacement, &quad);
 	}
 }
 
@@ -0,0 +1 @@
+../../../Components/ssim.c
\ No newline at end of file
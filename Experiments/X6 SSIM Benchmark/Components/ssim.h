@@ -0,0 +1 @@
+../../../Components/ssim.h
\ No newline at end of file
@@ -0,0 +1,640 @@
+/*
+ * Copyright (C) 2015 Michael Roitzsch <mroi@os.inf.tu-dresden.de>
+ * economic rights: Technische Universitaet Dresden (Germany)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "ssim.h"
+
+#define REPEAT 5
+/* the precision the preprocessing uses */
+#define PRECISION 0.05f
+/* allowed relative deviation of exact quality loss values from the reference */
+#define TOLERANCE 1e-5
+
+
+#pragma mark Scalar Reference
+
+/* the straightforward SSIM, evaluating the full 8x8 window at every pixel position */
+static double reference_block(const uint8_t *x, const uint8_t *y, unsigned line_stride)
+{
+	double mean_x = 0.0, mean_y = 0.0, var_x = 0.0, var_y = 0.0, covar_xy = 0.0;
+	const double n = 64, c1 = (0.01 * 255.0) * (0.01 * 255.0), c2 = (0.03 * 255.0) * (0.03 * 255.0);
+	unsigned i, j;
+	
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < 8; j++) {
+			const double x_ij = x[i * line_stride + j];
+			const double y_ij = y[i * line_stride + j];
+			mean_x   += x_ij;
+			mean_y   += y_ij;
+			var_x    += x_ij * x_ij;
+			var_y    += y_ij * y_ij;
+			covar_xy += x_ij * y_ij;
+		}
+	}
+	mean_x /= n;
+	mean_y /= n;
+	/* ssim.c scales with the integer ratio N / (N-1), which is 1 */
+	var_x    = (var_x    / (n-1)) - (mean_x * mean_x);
+	var_y    = (var_y    / (n-1)) - (mean_y * mean_y);
+	covar_xy = (covar_xy / (n-1)) - (mean_x * mean_y);
+	
+	return ((2 * mean_x * mean_y + c1) * (2 * covar_xy + c2)) /
+	((mean_x*mean_x + mean_y*mean_y + c1) * (var_x + var_y + c2));
+}
+
+static void reference_map(const uint8_t *x, const uint8_t *y, uint8_t *map, float *hist,
+						  unsigned width, unsigned height, unsigned line_stride)
+{
+	unsigned i, j;
+	
+	for (i = 0; i < height - 8; i++) {
+		for (j = 0; j < width - 8; j++) {
+			double ssim = 1 - reference_block(&x[i * line_stride + j], &y[i * line_stride + j], line_stride);
+			if (hist)
+				hist[(i + 4) * width + (j + 4)] += ssim;
+			if (ssim <= 0.0)
+				map[(i + 4) * line_stride + (j + 4)] = 0;
+			else if (ssim >= 1.0)
+				map[(i + 4) * line_stride + (j + 4)] = 255;
+			else
+				map[(i + 4) * line_stride + (j + 4)] = (uint8_t)(255 * ssim);
+		}
+	}
+}
+
+static double reference_plane_loss(const uint8_t *x, const uint8_t *y, unsigned width, unsigned height, unsigned line_stride)
+{
+	double loss = 0.0;
+	unsigned i, j;
+	
+	for (i = 0; i < height - 8; i++)
+		for (j = 0; j < width - 8; j++)
+			loss += 1 - reference_block(&x[i * line_stride + j], &y[i * line_stride + j], line_stride);
+	return loss;
+}
+
+/* ssim_quality_loss() over the whole picture with every window position evaluated */
+static double reference_quality_loss(const picture_t *x, const picture_t *y)
+{
+	/* one chroma window stands for four luma windows */
+	const double loss =
+	0.8 * reference_plane_loss(x->Y, y->Y, x->width, x->height, x->line_stride_Y) +
+	0.4 * reference_plane_loss(x->Cb, y->Cb, x->width / 2, x->height / 2, x->line_stride_Cb) +
+	0.4 * reference_plane_loss(x->Cr, y->Cr, x->width / 2, x->height / 2, x->line_stride_Cr);
+	return loss / (x->width * x->height);
+}
+
+/* number of window positions ssim_quality_loss() evaluates at precision 1 */
+static double windows(const picture_t *x)
+{
+	return
+	(double)(x->width - 8) * (x->height - 8) +
+	2.0 * (x->width / 2 - 8) * (x->height / 2 - 8);
+}
+
+#pragma mark -
+
+
+#pragma mark Test Pictures
+
+static double now(void)
+{
+	struct timeval time;
+	gettimeofday(&time, NULL);
+	return (double)time.tv_sec + (double)time.tv_usec / 1000000.0;
+}
+
+static int picture_alloc(picture_t *picture, unsigned width, unsigned height)
+{
+	uint8_t *buffer = malloc((size_t)width * height * 3 / 2);
+	if (!buffer) return 0;
+	
+	picture->Y  = buffer;
+	picture->Cb = buffer + (size_t)width * height;
+	picture->Cr = buffer + (size_t)width * height * 5 / 4;
+	picture->line_stride_Y  = width;
+	picture->line_stride_Cb = width / 2;
+	picture->line_stride_Cr = width / 2;
+	picture->width  = width;
+	picture->height = height;
+	return 1;
+}
+
+static void picture_free(picture_t *picture)
+{
+	free(picture->Y);
+}
+
+/* a smooth texture with some noise as the original, a noisier version of it as the degraded plane */
+static void synthesize_plane(uint8_t *x, uint8_t *y, unsigned width, unsigned height, uint32_t state)
+{
+	unsigned i, j;
+	
+	for (i = 0; i < height; i++) {
+		for (j = 0; j < width; j++) {
+			int value = (int)(128 + 60 * sin(i / 23.0) * cos(j / 37.0));
+			state = state * 1664525 + 1013904223;
+			value += (int)(state >> 28) - 8;
+			x[i * width + j] = (uint8_t)value;
+			state = state * 1664525 + 1013904223;
+			value += (int)(state >> 26) - 32;
+			y[i * width + j] = (uint8_t)(value < 0 ? 0 : (value > 255 ? 255 : value));
+		}
+	}
+}
+
+static void synthesize(picture_t *x, picture_t *y)
+{
+	synthesize_plane(x->Y,  y->Y,  x->width,     x->height,     42);
+	synthesize_plane(x->Cb, y->Cb, x->width / 2, x->height / 2, 23);
+	synthesize_plane(x->Cr, y->Cr, x->width / 2, x->height / 2, 17);
+}
+
+/* reads the first frame of a raw YUV 4:2:0 file */
+static int load(picture_t *picture, const char *file)
+{
+	const size_t size = (size_t)picture->width * picture->height * 3 / 2;
+	FILE *yuv = fopen(file, "r");
+	size_t read;
+	
+	if (!yuv) return 0;
+	read = fread(picture->Y, 1, size, yuv);
+	fclose(yuv);
+	return read == size;
+}
+
+/* a picture's plane p with its line stride */
+static uint8_t *plane(const picture_t *picture, unsigned p, uint_fast32_t *line_stride)
+{
+	*line_stride = (p == 0) ? picture->line_stride_Y : ((p == 1) ? picture->line_stride_Cb : picture->line_stride_Cr);
+	return (p == 0) ? picture->Y : ((p == 1) ? picture->Cb : picture->Cr);
+}
+
+static int picture_copy(picture_t *copy, const picture_t *picture)
+{
+	if (!picture_alloc(copy, picture->width, picture->height)) return 0;
+	memcpy(copy->Y, picture->Y, (size_t)picture->width * picture->height * 3 / 2);
+	return 1;
+}
+
+/* the picture reduced by 2x in both directions, averaging 2x2 pixels with rounding */
+static int reference_reduce(picture_t *reduced, const picture_t *picture)
+{
+	unsigned p, i, j;
+	
+	if (!picture_alloc(reduced, picture->width / 2, picture->height / 2)) return 0;
+	for (p = 0; p < 3; p++) {
+		const unsigned width  = p ? reduced->width  / 2 : reduced->width;
+		const unsigned height = p ? reduced->height / 2 : reduced->height;
+		uint_fast32_t src_stride, dst_stride;
+		const uint8_t *src = plane(picture, p, &src_stride);
+		uint8_t *dst = plane(reduced, p, &dst_stride);
+		for (i = 0; i < height; i++)
+			for (j = 0; j < width; j++)
+				dst[i * dst_stride + j] = (uint8_t)((src[2*i * src_stride + 2*j] + src[2*i * src_stride + 2*j+1] +
+													 src[(2*i+1) * src_stride + 2*j] + src[(2*i+1) * src_stride + 2*j+1] + 2) >> 2);
+	}
+	return 1;
+}
+
+/* x with the pixels of y copied in within the blocks whose bin is the given one */
+static void reference_bin_picture(picture_t *z, const picture_t *x, const picture_t *y, const ssim_bins_t *bins, unsigned bin)
+{
+	unsigned p, i, j;
+	
+	for (p = 0; p < 3; p++) {
+		const unsigned subsampling = p ? 1 : 0;
+		uint_fast32_t stride_x, stride_y, stride_z;
+		const uint8_t *plane_x = plane(x, p, &stride_x);
+		const uint8_t *plane_y = plane(y, p, &stride_y);
+		uint8_t *plane_z = plane(z, p, &stride_z);
+		for (i = 0; i < (x->height >> subsampling); i++)
+			for (j = 0; j < (x->width >> subsampling); j++) {
+				const uint16_t block_bin = bins->map[((i << subsampling) >> bins->block_size_log) * bins->line_stride + ((j << subsampling) >> bins->block_size_log)];
+				plane_z[i * stride_z + j] = (block_bin == bin) ? plane_y[i * stride_y + j] : plane_x[i * stride_x + j];
+			}
+	}
+}
+
+/* assembles the picture a patchwork describes */
+static void reference_patchwork_picture(picture_t *z, const ssim_patchwork_t *work)
+{
+	unsigned p, i, j;
+	
+	for (p = 0; p < 3; p++) {
+		const unsigned subsampling = p ? 1 : 0;
+		uint_fast32_t stride_z;
+		uint8_t *plane_z = plane(z, p, &stride_z);
+		for (i = 0; i < (z->height >> subsampling); i++)
+			for (j = 0; j < (z->width >> subsampling); j++) {
+				const ssim_patch_t *patch = &work->patch[((i << subsampling) >> work->block_size_log) * work->line_stride + ((j << subsampling) >> work->block_size_log)];
+				uint_fast32_t stride_source;
+				if (patch->source) {
+					const uint8_t *source = plane(patch->source, p, &stride_source);
+					plane_z[i * stride_z + j] = source[(i + (patch->dy >> subsampling)) * stride_source + (j + (patch->dx >> subsampling))];
+				} else {
+					plane_z[i * stride_z + j] = patch->constant[p];
+				}
+			}
+	}
+}
+
+/* a clearly worse version of y: the left half inverted */
+static void degrade(picture_t *z, const picture_t *y)
+{
+	unsigned p, i, j;
+	
+	memcpy(z->Y, y->Y, (size_t)y->width * y->height * 3 / 2);
+	for (p = 0; p < 3; p++) {
+		const unsigned subsampling = p ? 1 : 0;
+		uint_fast32_t stride;
+		uint8_t *plane_z = plane(z, p, &stride);
+		for (i = 0; i < (z->height >> subsampling); i++)
+			for (j = 0; j < (z->width >> subsampling) / 2; j++)
+				plane_z[i * stride + j] = 255 - plane_z[i * stride + j];
+	}
+}
+
+#pragma mark -
+
+
+#pragma mark Benchmarks
+
+static int benchmark_map(const picture_t *x, const picture_t *y)
+{
+	const size_t size = (size_t)x->width * x->height;
+	uint8_t *map_reference = calloc(size, 1);
+	uint8_t *map = calloc(size, 1);
+	float *hist_reference = calloc(size, sizeof(float));
+	float *hist = calloc(size, sizeof(float));
+	double start, time_reference, time_map, hist_delta = 0.0;
+	size_t mismatches = 0, i;
+	int repeat;
+	
+	if (!map_reference || !map || !hist_reference || !hist) return 1;
+	
+	start = now();
+	for (repeat = 0; repeat < REPEAT; repeat++)
+		reference_map(x->Y, y->Y, map_reference, hist_reference, x->width, x->height, x->line_stride_Y);
+	time_reference = (now() - start) / REPEAT;
+	
+	start = now();
+	for (repeat = 0; repeat < REPEAT; repeat++)
+		ssim_map(x->Y, y->Y, map, hist, x->width, x->height, x->line_stride_Y);
+	time_map = (now() - start) / REPEAT;
+	
+	for (i = 0; i < size; i++) {
+		if (map[i] != map_reference[i])
+			mismatches++;
+		if (fabs(hist[i] - hist_reference[i]) > hist_delta)
+			hist_delta = fabs(hist[i] - hist_reference[i]);
+	}
+	
+	printf("  ssim_map: per-window %.1f Mpixel/s, sliding window %.1f Mpixel/s, speedup %.1fx, map mismatches %zu, histogram delta %g\n",
+		   size / time_reference / 1e6, size / time_map / 1e6, time_reference / time_map, mismatches, hist_delta);
+	
+	free(map_reference);
+	free(map);
+	free(hist_reference);
+	free(hist);
+	
+	return mismatches > 0;
+}
+
+static int benchmark_kernels(const picture_t *x, const picture_t *y)
+{
+	static const struct {
+		ssim_kernel_t kernel;
+		const char *name;
+	} kernels[] = {
+		{ SSIM_KERNEL_SCALAR, "scalar" },
+		{ SSIM_KERNEL_SSE41,  "SSE4.1" },
+		{ SSIM_KERNEL_AVX2,   "AVX2"   }
+	};
+	const double reference = reference_quality_loss(x, y);
+	int result = 0;
+	unsigned k;
+	
+	for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		double start, time, deviation;
+		float loss = 0.0f;
+		int repeat;
+		
+		if (!ssim_kernel_select(kernels[k].kernel)) {
+			printf("  %-6s kernel: not supported by this CPU\n", kernels[k].name);
+			continue;
+		}
+		start = now();
+		for (repeat = 0; repeat < REPEAT; repeat++)
+			loss = ssim_quality_loss(x, y, NULL, 1.0f, 0);
+		time = (now() - start) / REPEAT;
+		
+		deviation = fabs(loss - reference) / reference;
+		printf("  %-6s kernel: %.1f ns per block, %.1f Mpixel/s, quality loss %g, reference deviation %g\n",
+			   kernels[k].name, 1e9 * time / windows(x), x->width * x->height / time / 1e6, loss, deviation);
+		if (deviation > TOLERANCE)
+			result = 1;
+	}
+	ssim_kernel_select(SSIM_KERNEL_AUTO);
+	
+	return result;
+}
+
+static void benchmark_sampling(const picture_t *x, const picture_t *y)
+{
+	const float exact = ssim_quality_loss(x, y, NULL, 1.0f, 0);
+	double start, time, deviation = 0.0;
+	int repeat;
+	
+	start = now();
+	for (repeat = 0; repeat < REPEAT; repeat++) {
+		const float loss = ssim_quality_loss(x, y, NULL, PRECISION, (uint64_t)repeat);
+		deviation += fabs(loss - exact) / exact;
+	}
+	time = (now() - start) / REPEAT;
+	
+	printf("  sampled at precision %g: %.1f Mpixel/s, mean deviation from exact %.2f%%\n",
+		   PRECISION, x->width * x->height / time / 1e6, 100.0 * deviation / REPEAT);
+}
+
+/* the binned quality loss of every bin equals the loss of the picture with only that bin changed */
+static int check_binned(const picture_t *x, const picture_t *y)
+{
+	enum { BLOCK_SIZE_LOG = 4, BINS = 4 };
+	const unsigned columns = (x->width  + (1 << BLOCK_SIZE_LOG) - 1) >> BLOCK_SIZE_LOG;
+	const unsigned rows    = (x->height + (1 << BLOCK_SIZE_LOG) - 1) >> BLOCK_SIZE_LOG;
+	uint16_t *map = malloc(columns * rows * sizeof(uint16_t));
+	ssim_bins_t bins = { map, columns, BLOCK_SIZE_LOG, BINS };
+	float loss[BINS];
+	double deviation = 0.0;
+	uint32_t state = 7;
+	picture_t z;
+	unsigned bin, i;
+	
+	if (!map || !picture_alloc(&z, x->width, x->height)) return 1;
+	/* bins in irregular shapes, with one bin number beyond the count to be ignored */
+	for (i = 0; i < columns * rows; i++) {
+		state = state * 1664525 + 1013904223;
+		map[i] = (uint16_t)((state >> 24) % (BINS + 1));
+	}
+	
+	ssim_quality_loss_binned(x, y, &bins, 1.0f, 0, loss);
+	for (bin = 0; bin < BINS; bin++) {
+		double reference;
+		reference_bin_picture(&z, x, y, &bins, bin);
+		reference = reference_quality_loss(x, &z);
+		if (fabs(loss[bin] - reference) / reference > deviation)
+			deviation = fabs(loss[bin] - reference) / reference;
+	}
+	
+	printf("  ssim_quality_loss_binned: %d bins, reference deviation %g\n", BINS, deviation);
+	
+	picture_free(&z);
+	free(map);
+	
+	return deviation > TOLERANCE;
+}
+
+/* the pyramid levels match the reference on reduced pictures, updates match a fresh reset */
+static int check_pyramid(const picture_t *x, const picture_t *y)
+{
+	const change_rect_t rect = { x->width / 4, x->height / 4, x->width / 2 + 3, x->height / 2 + 5 };
+	ssim_pyramid_t *pyramid = ssim_pyramid_alloc(2), *fresh = ssim_pyramid_alloc(2);
+	picture_t reduced_x[2], reduced_y[2], z;
+	double deviation = 0.0;
+	size_t mismatches = 0;
+	unsigned level, i;
+	
+	if (!pyramid || !fresh || !picture_copy(&z, y)) return 1;
+	if (!reference_reduce(&reduced_x[0], x) || !reference_reduce(&reduced_y[0], y)) return 1;
+	if (!reference_reduce(&reduced_x[1], &reduced_x[0]) || !reference_reduce(&reduced_y[1], &reduced_y[0])) return 1;
+	
+	ssim_pyramid_reset(pyramid, x, &z, 1.0f, 0);
+	for (level = 0; level <= 2; level++) {
+		const float loss = ssim_pyramid_quality_loss(pyramid, NULL, level);
+		const double reference = level ? reference_quality_loss(&reduced_x[level - 1], &reduced_y[level - 1]) : reference_quality_loss(x, y);
+		if (fabs(loss - reference) / reference > deviation)
+			deviation = fabs(loss - reference) / reference;
+	}
+	
+	/* level 0 is the full resolution loss with the same seed */
+	ssim_pyramid_reset(pyramid, x, &z, PRECISION, 1);
+	if (ssim_pyramid_quality_loss(pyramid, &rect, 0) != ssim_quality_loss(x, &z, &rect, PRECISION, 1))
+		mismatches++;
+	
+	/* change a rect that is not aligned to the reductions */
+	for (i = rect.min_y; i < rect.max_y; i++)
+		memset(&z.Y[i * z.line_stride_Y + rect.min_x], 0, rect.max_x - rect.min_x);
+	for (i = rect.min_y / 2; i < rect.max_y / 2; i++) {
+		memset(&z.Cb[i * z.line_stride_Cb + rect.min_x / 2], 255, (rect.max_x - rect.min_x) / 2);
+		memset(&z.Cr[i * z.line_stride_Cr + rect.min_x / 2], 255, (rect.max_x - rect.min_x) / 2);
+	}
+	ssim_pyramid_update(pyramid, &rect);
+	ssim_pyramid_reset(fresh, x, &z, PRECISION, 1);
+	for (level = 0; level <= 2; level++) {
+		if (ssim_pyramid_quality_loss(pyramid, NULL, level) != ssim_pyramid_quality_loss(fresh, NULL, level))
+			mismatches++;
+		if (ssim_pyramid_quality_loss(pyramid, &rect, level) != ssim_pyramid_quality_loss(fresh, &rect, level))
+			mismatches++;
+	}
+	
+	printf("  ssim_pyramid: reference deviation %g, update mismatches %zu\n", deviation, mismatches);
+	
+	ssim_pyramid_free(pyramid);
+	ssim_pyramid_free(fresh);
+	for (level = 0; level < 2; level++) {
+		picture_free(&reduced_x[level]);
+		picture_free(&reduced_y[level]);
+	}
+	picture_free(&z);
+	
+	return deviation > TOLERANCE || mismatches > 0;
+}
+
+/* the sequential comparison decides clear cases like the exact quality loss values,
+ * and a patchwork compares exactly like the picture it describes */
+static int check_compare(const picture_t *x, const picture_t *y)
+{
+	enum { BLOCK_SIZE_LOG = 4 };
+	const unsigned columns = (x->width  + (1 << BLOCK_SIZE_LOG) - 1) >> BLOCK_SIZE_LOG;
+	const unsigned rows    = (x->height + (1 << BLOCK_SIZE_LOG) - 1) >> BLOCK_SIZE_LOG;
+	ssim_patch_t *patch1 = malloc(columns * rows * sizeof(ssim_patch_t));
+	ssim_patch_t *patch2 = malloc(columns * rows * sizeof(ssim_patch_t));
+	const ssim_patchwork_t work1 = { patch1, columns, BLOCK_SIZE_LOG }, work2 = { patch2, columns, BLOCK_SIZE_LOG };
+	size_t wrong = 0, mismatches = 0;
+	double difference;
+	picture_t degraded, assembled;
+	unsigned i, j, k;
+	
+	if (!patch1 || !patch2) return 1;
+	if (!picture_alloc(&degraded, x->width, x->height) || !picture_alloc(&assembled, x->width, x->height)) return 1;
+	
+	degrade(&degraded, y);
+	difference = reference_quality_loss(x, &degraded) - reference_quality_loss(x, y);
+	if (!ssim_quality_loss_compare(x, y, &degraded, NULL, (float)(2.0 * difference), 1.0f, 0)) wrong++;
+	if ( ssim_quality_loss_compare(x, y, &degraded, NULL, (float)(0.5 * difference), 1.0f, 0)) wrong++;
+	if (!ssim_quality_loss_compare(x, &degraded, y, NULL, 0.0f, 1.0f, 0)) wrong++;
+	
+	/* patches of the degraded picture, of the original displaced by one block, and constant ones */
+	for (i = 0; i < rows; i++) {
+		for (j = 0; j < columns; j++) {
+			ssim_patch_t *patch = &patch2[i * columns + j];
+			patch1[i * columns + j] = (ssim_patch_t){ y, 0, 0, { 0, 0, 0 } };
+			switch ((i + 2 * j) % 3) {
+				case 0: *patch = (ssim_patch_t){ &degraded, 0, 0, { 0, 0, 0 } }; break;
+				case 1: *patch = (ssim_patch_t){ x, (j + 1 < columns) ? 1 << BLOCK_SIZE_LOG : -(1 << BLOCK_SIZE_LOG), 0, { 0, 0, 0 } }; break;
+				case 2: *patch = (ssim_patch_t){ NULL, 0, 0, { 16, 128, 240 } }; break;
+			}
+		}
+	}
+	reference_patchwork_picture(&assembled, &work2);
+	difference = reference_quality_loss(x, &assembled) - reference_quality_loss(x, y);
+	if (!ssim_patchwork_compare(x, &work1, &work2, NULL, (float)(2.0 * difference), 1.0f, 0)) wrong++;
+	if ( ssim_patchwork_compare(x, &work1, &work2, NULL, (float)(0.5 * difference), 1.0f, 0)) wrong++;
+	/* close to the threshold where the decision flips, it depends on every sampled window */
+	for (k = 0; k < 4; k++) {
+		float below = (float)(0.5 * difference), above = (float)(2.0 * difference);
+		for (i = 0; i < 32; i++) {
+			const float threshold = (below + above) / 2;
+			if (ssim_quality_loss_compare(x, y, &assembled, NULL, threshold, PRECISION, k))
+				above = threshold;
+			else
+				below = threshold;
+		}
+		if (ssim_patchwork_compare(x, &work1, &work2, NULL, below, PRECISION, k) ||
+			!ssim_patchwork_compare(x, &work1, &work2, NULL, above, PRECISION, k))
+			mismatches++;
+	}
+	
+	printf("  ssim_quality_loss_compare: wrong decisions %zu, patchwork mismatches %zu\n", wrong, mismatches);
+	
+	picture_free(&degraded);
+	picture_free(&assembled);
+	free(patch1);
+	free(patch2);
+	
+	return wrong > 0 || mismatches > 0;
+}
+
+static void benchmark_threads(const picture_t *x, const picture_t *y)
+{
+#ifdef _OPENMP
+	const int max_threads = omp_get_max_threads();
+	const size_t size = (size_t)x->width * x->height;
+	uint8_t *map = calloc(size, 1);
+	double time_map_single = 0.0, time_loss_single = 0.0;
+	int threads, repeat;
+	
+	if (!map) return;
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		double start, time_map, time_loss;
+		
+		omp_set_num_threads(threads);
+		start = now();
+		for (repeat = 0; repeat < REPEAT; repeat++)
+			ssim_map(x->Y, y->Y, map, NULL, x->width, x->height, x->line_stride_Y);
+		time_map = (now() - start) / REPEAT;
+		start = now();
+		for (repeat = 0; repeat < REPEAT; repeat++)
+			ssim_quality_loss(x, y, NULL, 1.0f, 0);
+		time_loss = (now() - start) / REPEAT;
+		
+		if (threads == 1) {
+			time_map_single = time_map;
+			time_loss_single = time_loss;
+		}
+		printf("  %2d threads: ssim_map %.1f Mpixel/s (%.2fx), ssim_quality_loss %.1f Mpixel/s (%.2fx)\n",
+			   threads, size / time_map / 1e6, time_map_single / time_map,
+			   size / time_loss / 1e6, time_loss_single / time_loss);
+	}
+	omp_set_num_threads(max_threads);
+	free(map);
+#else
+	(void)x;
+	(void)y;
+	printf("  thread scaling: built without OpenMP\n");
+#endif
+}
+
+static int benchmark(const char *name, const picture_t *x, const picture_t *y)
+{
+	int result = 0;
+	
+	printf("%s %ux%u:\n", name, (unsigned)x->width, (unsigned)x->height);
+	result |= benchmark_map(x, y);
+	result |= benchmark_kernels(x, y);
+	benchmark_sampling(x, y);
+	result |= check_binned(x, y);
+	result |= check_pyramid(x, y);
+	result |= check_compare(x, y);
+	benchmark_threads(x, y);
+	
+	return result;
+}
+
+static int benchmark_synthetic(unsigned width, unsigned height)
+{
+	picture_t x, y;
+	int result;
+	
+	if (!picture_alloc(&x, width, height) || !picture_alloc(&y, width, height)) return 1;
+	synthesize(&x, &y);
+	result = benchmark("synthetic", &x, &y);
+	picture_free(&x);
+	picture_free(&y);
+	
+	return result;
+}
+
+static int benchmark_recorded(const char *size, const char *original, const char *degraded)
+{
+	unsigned width, height;
+	picture_t x, y;
+	int result;
+	
+	if (sscanf(size, "%ux%u", &width, &height) != 2) return 1;
+	if (!picture_alloc(&x, width, height) || !picture_alloc(&y, width, height)) return 1;
+	if (!load(&x, original) || !load(&y, degraded)) {
+		fprintf(stderr, "could not read %ux%u frames from %s and %s\n", width, height, original, degraded);
+		return 1;
+	}
+	result = benchmark("recorded", &x, &y);
+	picture_free(&x);
+	picture_free(&y);
+	
+	return result;
+}
+
+#pragma mark -
+
+
+/* usage: ssim_bench [<width>x<height> <original.yuv> <degraded.yuv>]
+ * returns non-zero if any result disagrees with the scalar reference */
+int main(int argc, char **argv)
+{
+	int result = 0;
+	
+	if (argc != 1 && argc != 4) {
+		fprintf(stderr, "usage: %s [<width>x<height> <original.yuv> <degraded.yuv>]\n", argv[0]);
+		return 1;
+	}
+	
+	result |= benchmark_synthetic(640, 360);
+	result |= benchmark_synthetic(1280, 720);
+	result |= benchmark_synthetic(1920, 1080);
+	if (argc == 4)
+		result |= benchmark_recorded(argv[1], argv[2], argv[3]);
+	
+	return result;
+}
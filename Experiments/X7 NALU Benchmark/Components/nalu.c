@@ -0,0 +1 @@
+../../../Components/nalu.c
\ No newline at end of file
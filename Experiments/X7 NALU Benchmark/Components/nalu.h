@@ -0,0 +1 @@
+../../../Components/nalu.h
\ No newline at end of file
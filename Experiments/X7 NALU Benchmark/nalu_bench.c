@@ -0,0 +1,458 @@
+/*
+ * Copyright (C) 2015 Michael Roitzsch <mroi@os.inf.tu-dresden.de>
+ * economic rights: Technische Universitaet Dresden (Germany)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "libavcodec/avcodec.h"
+#include "nalu.h"
+
+#define REPEAT 20
+/* the reader may look ahead this far, FFmpeg pads its buffers likewise */
+#define PADDING 16
+/* scratch files for the re-encoded metadata, nalu_write_alloc() derives the output name */
+#define WRITE_SOURCE "nalu_bench.h264"
+#define WRITE_TARGET "nalu_bench.h264_" FILE_SUFFIX
+#define WRITE_REFERENCE "nalu_bench.reference"
+
+
+#pragma mark Bitwise Reference
+
+/* the original reader, one bit at a time and without emulation prevention handling */
+typedef struct {
+	const uint8_t *nalu;
+	uint_fast8_t byte;
+	uint_fast8_t bits;
+} bitwise_read_t;
+
+static void bitwise_read_start(bitwise_read_t *read, const uint8_t *nalu)
+{
+	read->nalu = nalu;
+	read->byte = *nalu;
+	read->bits = 8;
+}
+
+static inline uint_fast8_t bitwise_read_bit(bitwise_read_t *read)
+{
+	uint_fast8_t bit = (read->byte >> 7) & 1;
+	read->byte <<= 1;
+	if (!(--read->bits)) {
+		read->nalu++;
+		read->byte = *read->nalu;
+		read->bits = 8;
+	}
+	return bit;
+}
+
+static uint_fast32_t bitwise_read_unsigned(bitwise_read_t *read)
+{
+	size_t leading_zeros = 0;
+	while (bitwise_read_bit(read) == 0)
+		leading_zeros++;
+	assert(leading_zeros < 32);
+	
+	uint_fast32_t coded = 1;
+	while (leading_zeros--)
+		coded = (coded << 1) | bitwise_read_bit(read);
+	
+	return coded - 1;
+}
+
+/* the original writer, one fwrite() per byte with emulation prevention through a byte history */
+typedef struct {
+	FILE *to;
+	uint8_t history[3];
+	uint8_t byte;
+	uint_fast8_t bits;
+} bitwise_write_t;
+
+static void bitwise_write_start(bitwise_write_t *write)
+{
+	const uint8_t custom[4] = { 0x00, 0x00, 0x01, NAL_METADATA };
+	
+	fwrite(custom, 1, 4, write->to);
+	write->history[2] = 0xFF;
+	write->byte = 0;
+	write->bits = 0;
+}
+
+static inline void bitwise_write_bit(bitwise_write_t *write, uint_fast8_t bit)
+{
+	write->byte <<= 1;
+	write->byte |= bit;
+	if (++write->bits == 8) {
+		const uint8_t fill = 0x03;
+		
+		write->history[0] = write->history[1];
+		write->history[1] = write->history[2];
+		write->history[2] = write->byte;
+		if (write->history[0] == 0 && write->history[1] == 0 && write->history[2] < 4) {
+			fwrite(&fill, 1, 1, write->to);
+			write->history[1] = 0xFF;
+		}
+		
+		fwrite(&write->byte, 1, 1, write->to);
+		write->byte = 0;
+		write->bits = 0;
+	}
+}
+
+static void bitwise_write_unsigned(bitwise_write_t *write, uint_fast32_t value)
+{
+	value = value + 1;
+	
+	uint_fast32_t temp = value;
+	size_t significant_bits = 0;
+	while (temp) {
+		significant_bits++;
+		temp >>= 1;
+	}
+	for (size_t i = 1; i < significant_bits; i++)
+		bitwise_write_bit(write, 0);
+	
+	while (significant_bits--)
+		bitwise_write_bit(write, (value >> significant_bits) & 1);
+}
+
+static void bitwise_write_end(bitwise_write_t *write)
+{
+	while (write->bits)
+		bitwise_write_bit(write, 0);
+}
+
+#pragma mark -
+
+
+#pragma mark Metadata Extraction
+
+typedef struct {
+	/* payload after the NALU header byte, as stored in the file */
+	const uint8_t *escaped;
+	size_t escaped_size;
+	/* the same payload with emulation prevention bytes removed */
+	uint8_t *unescaped;
+	size_t unescaped_size;
+} metadata_t;
+
+static double now(void)
+{
+	struct timeval time;
+	gettimeofday(&time, NULL);
+	return (double)time.tv_sec + (double)time.tv_usec / 1000000.0;
+}
+
+static uint8_t *load(const char *filename, size_t *size)
+{
+	FILE *file = fopen(filename, "r");
+	if (!file) return NULL;
+	fseeko(file, 0, SEEK_END);
+	*size = (size_t)ftello(file);
+	fseeko(file, 0, SEEK_SET);
+	
+	uint8_t *buffer = calloc(*size + PADDING, 1);
+	if (buffer && fread(buffer, 1, *size, file) != *size) {
+		free(buffer);
+		buffer = NULL;
+	}
+	fclose(file);
+	return buffer;
+}
+
+static size_t extract(const uint8_t *data, size_t size, metadata_t **result)
+{
+	size_t count = 0, capacity = 0;
+	metadata_t *metadata = NULL;
+	
+	for (size_t i = 0; i + 4 <= size; i++) {
+		if (data[i] != 0 || data[i+1] != 0 || data[i+2] != 1 || (data[i+3] & 0x1F) != NAL_METADATA)
+			continue;
+		
+		size_t end;
+		for (end = i + 4; end + 3 <= size; end++)
+			if (data[end] == 0 && data[end+1] == 0 && data[end+2] == 1)
+				break;
+		if (end + 3 > size) end = size;
+		
+		if (count == capacity) {
+			capacity = capacity ? 2 * capacity : 1024;
+			metadata = realloc(metadata, capacity * sizeof(metadata_t));
+			if (!metadata) abort();
+		}
+		metadata_t *current = &metadata[count++];
+		current->escaped = &data[i + 4];
+		current->escaped_size = end - (i + 4);
+		current->unescaped = calloc(current->escaped_size + PADDING, 1);
+		if (!current->unescaped) abort();
+		
+		size_t zeros = 0, j = 0;
+		for (size_t k = 0; k < current->escaped_size; k++) {
+			const uint8_t byte = current->escaped[k];
+			if (zeros >= 2 && byte == 0x03) {
+				zeros = 0;
+				continue;
+			}
+			zeros = byte ? 0 : zeros + 1;
+			current->unescaped[j++] = byte;
+		}
+		current->unescaped_size = j;
+		i = end - 1;
+	}
+	
+	*result = metadata;
+	return count;
+}
+
+#pragma mark -
+
+
+#pragma mark Benchmarks
+
+typedef struct {
+	metadata_t *metadata;
+	size_t count;
+	uint8_t *data;
+} encoding_t;
+
+/* the values ffplay extracts from each metadata NALU: frame size, slice count, slice metrics */
+static size_t decode(nalu_read_t *read, const metadata_t *metadata, size_t count, size_t *values, uint_fast32_t **result)
+{
+	size_t total = 0, capacity = 1024;
+	uint_fast32_t *decoded = malloc(capacity * sizeof(uint_fast32_t));
+	
+	for (size_t i = 0; i < count; i++) {
+		nalu_read_start_escaped(read, metadata[i].escaped);
+		const uint_fast32_t fields = nalu_read_fields(read);
+		uint_fast32_t header[3];
+		for (size_t j = 0; j < 3; j++)
+			header[j] = nalu_read_unsigned(read);
+		values[i] = 3 + fields * header[2];
+		if (total + values[i] > capacity) {
+			while (total + values[i] > capacity)
+				capacity *= 2;
+			decoded = realloc(decoded, capacity * sizeof(uint_fast32_t));
+			if (!decoded) abort();
+		}
+		for (size_t j = 0; j < 3; j++)
+			decoded[total++] = header[j];
+		for (size_t j = 3; j < values[i]; j++)
+			decoded[total++] = nalu_read_unsigned(read);
+	}
+	
+	*result = decoded;
+	return total;
+}
+
+static double encode(const uint_fast32_t *decoded, size_t count, const size_t *values, uint_fast8_t version, encoding_t *encoding)
+{
+	const double start = now();
+	nalu_write_t *write = nalu_write_alloc(WRITE_SOURCE, false);
+	for (size_t i = 0; i < count; i++) {
+		const size_t fields = values[i] > 3 ? (values[i] - 3) / decoded[2] : 0;
+		nalu_write_start(write, version, (uint_fast32_t)(version >= 2 ? fields : 0), 0);
+		for (size_t j = 0; j < values[i]; j++)
+			nalu_write_unsigned(write, *decoded++);
+		nalu_write_end(write);
+	}
+	nalu_write_free(write);
+	const double time = now() - start;
+	
+	size_t size;
+	encoding->data = load(WRITE_TARGET, &size);
+	encoding->count = encoding->data ? extract(encoding->data, size, &encoding->metadata) : 0;
+	remove(WRITE_TARGET);
+	return time;
+}
+
+static double encode_bitwise(const uint_fast32_t *decoded, size_t count, const size_t *values)
+{
+	const double start = now();
+	bitwise_write_t reference = { .to = fopen(WRITE_REFERENCE, "w") };
+	for (size_t i = 0; i < count; i++) {
+		bitwise_write_start(&reference);
+		for (size_t j = 0; j < values[i]; j++)
+			bitwise_write_unsigned(&reference, *decoded++);
+		bitwise_write_end(&reference);
+	}
+	fclose(reference.to);
+	return now() - start;
+}
+
+static void encoding_free(encoding_t *encoding)
+{
+	for (size_t i = 0; i < encoding->count; i++)
+		free(encoding->metadata[i].unescaped);
+	if (encoding->count)
+		free(encoding->metadata);
+	free(encoding->data);
+}
+
+static uint_fast32_t checksum_bitwise(const encoding_t *encoding, const size_t *values)
+{
+	uint_fast32_t sum = 0;
+	bitwise_read_t read;
+	for (size_t i = 0; i < encoding->count; i++) {
+		bitwise_read_start(&read, encoding->metadata[i].unescaped);
+		for (size_t j = 0; j < values[i]; j++)
+			sum = sum * 31 + bitwise_read_unsigned(&read);
+	}
+	return sum;
+}
+
+static uint_fast32_t checksum_cached(nalu_read_t *read, const encoding_t *encoding, const size_t *values, int escaped)
+{
+	uint_fast32_t sum = 0;
+	for (size_t i = 0; i < encoding->count; i++) {
+		if (escaped)
+			nalu_read_start_escaped(read, encoding->metadata[i].escaped);
+		else
+			nalu_read_start(read, encoding->metadata[i].unescaped);
+		for (size_t j = 0; j < values[i]; j++)
+			sum = sum * 31 + nalu_read_unsigned(read);
+	}
+	return sum;
+}
+
+static int mismatches(nalu_read_t *read, const encoding_t *encoding, const size_t *values,
+					  const uint_fast32_t *decoded, int escaped)
+{
+	int result = 0;
+	for (size_t i = 0; i < encoding->count; i++) {
+		if (escaped)
+			nalu_read_start_escaped(read, encoding->metadata[i].escaped);
+		else
+			nalu_read_start(read, encoding->metadata[i].unescaped);
+		int wrong = 0;
+		for (size_t j = 0; j < values[i]; j++)
+			wrong |= (nalu_read_unsigned(read) != *decoded++);
+		result += wrong;
+	}
+	return result;
+}
+
+static double time_cached(nalu_read_t *read, const encoding_t *encoding, const size_t *values, int escaped)
+{
+	volatile uint_fast32_t sink;
+	const double start = now();
+	for (int i = 0; i < REPEAT; i++)
+		sink = checksum_cached(read, encoding, values, escaped);
+	(void)sink;
+	return (now() - start) / REPEAT;
+}
+
+static size_t encoding_size(const encoding_t *encoding)
+{
+	size_t size = 0;
+	for (size_t i = 0; i < encoding->count; i++)
+		size += encoding->metadata[i].escaped_size;
+	return size;
+}
+
+static void report(const char *name, double time, double reference, size_t bytes, size_t values, int wrong)
+{
+	printf("  %-22s %8.3f ms  %8.1f MiB/s  %8.1f Mvalues/s  speedup %5.2f  mismatches %d\n", name,
+		   time * 1000.0, (double)bytes / (1024.0 * 1024.0) / time, (double)values / 1000000.0 / time,
+		   reference / time, wrong);
+}
+
+static int benchmark(const char *filename)
+{
+	int result = 0;
+	size_t size;
+	uint8_t *data = load(filename, &size);
+	if (!data) {
+		fprintf(stderr, "could not read %s\n", filename);
+		return 1;
+	}
+	
+	/* the file may use either layout, the values are re-encoded in both */
+	nalu_read_t *read = nalu_read_alloc();
+	metadata_t *metadata;
+	const size_t count = extract(data, size, &metadata);
+	size_t *values = malloc((count ? count : 1) * sizeof(size_t));
+	uint_fast32_t *decoded;
+	const size_t total_values = decode(read, metadata, count, values, &decoded);
+	
+	size_t escapes = 0;
+	for (size_t i = 0; i < count; i++)
+		escapes += metadata[i].escaped_size - metadata[i].unescaped_size;
+	printf("%s: %zu metadata NALUs in version %u, %zu emulation prevention bytes, %zu values\n",
+		   filename, count, count ? (unsigned)nalu_read_version(read) : 0, escapes, total_values);
+	
+	/* writing: the buffered version 1 output must match the old writer byte for byte */
+	encoding_t v1, v2;
+	const double bitwise_write = encode_bitwise(decoded, count, values);
+	const double v1_write = encode(decoded, count, values, 1, &v1);
+	const double v2_write = encode(decoded, count, values, 2, &v2);
+	
+	size_t reference_size;
+	uint8_t *reference_data = load(WRITE_REFERENCE, &reference_size);
+	remove(WRITE_REFERENCE);
+	size_t v1_size = 0;
+	for (size_t i = 0; i < v1.count; i++)
+		v1_size += 4 + v1.metadata[i].escaped_size;
+	const int identical = reference_data && v1.data && reference_size == v1_size &&
+		memcmp(reference_data, v1.data, reference_size) == 0;
+	free(reference_data);
+	
+	const size_t v1_bytes = encoding_size(&v1), v2_bytes = encoding_size(&v2);
+	report("write v1 bitwise:", bitwise_write, bitwise_write, v1_bytes, total_values, 0);
+	report("write v1 buffered:", v1_write, bitwise_write, v1_bytes, total_values, !identical);
+	report("write v2:", v2_write, bitwise_write, v2_bytes, total_values, 0);
+	result |= !identical;
+	
+	/* reading: the old bitwise reader on version 1 is the baseline */
+	volatile uint_fast32_t sink;
+	double start = now();
+	for (int i = 0; i < REPEAT; i++)
+		sink = checksum_bitwise(&v1, values);
+	(void)sink;
+	const double bitwise_read = (now() - start) / REPEAT;
+	
+	int wrong;
+	report("read v1 bitwise:", bitwise_read, bitwise_read, v1_bytes, total_values, 0);
+	wrong = mismatches(read, &v1, values, decoded, 0);
+	report("read v1 unescaped:", time_cached(read, &v1, values, 0), bitwise_read, v1_bytes, total_values, wrong);
+	result |= wrong;
+	wrong = mismatches(read, &v1, values, decoded, 1);
+	report("read v1 escaped:", time_cached(read, &v1, values, 1), bitwise_read, v1_bytes, total_values, wrong);
+	result |= wrong;
+	wrong = mismatches(read, &v2, values, decoded, 0);
+	report("read v2 unescaped:", time_cached(read, &v2, values, 0), bitwise_read, v2_bytes, total_values, wrong);
+	result |= wrong;
+	wrong = mismatches(read, &v2, values, decoded, 1);
+	report("read v2 escaped:", time_cached(read, &v2, values, 1), bitwise_read, v2_bytes, total_values, wrong);
+	result |= wrong;
+	
+	encoding_free(&v1);
+	encoding_free(&v2);
+	nalu_read_free(read);
+	for (size_t i = 0; i < count; i++)
+		free(metadata[i].unescaped);
+	free(metadata);
+	free(values);
+	free(decoded);
+	free(data);
+	
+	return result != 0;
+}
+
+int main(int argc, char **argv)
+{
+	int result = 0;
+	
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <file.h264_metrics> ...\n", argv[0]);
+		return 1;
+	}
+	
+	for (int i = 1; i < argc; i++)
+		result |= benchmark(argv[i]);
+	
+	return result;
+}
@@ -3,11 +3,54 @@
  * economic rights: Technische Universitaet Dresden (Germany)
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
 #include "process.h"
 #include "libavformat/avformat.h"
 
+#ifndef THREADS
+#define THREADS 1
+#endif
+
+/* the stream is split into this many parts per thread, so uneven GOPs balance out */
+#define PARTS_PER_THREAD 4
+/* buffer size for feeding a part to the demuxer */
+#define PART_IO_SIZE (1 << 16)
+
+/* a range of the stream, preceded by the most recent parameter sets ahead of it if it has none */
+typedef struct {
+	const uint8_t *prefix, *data;
+	size_t prefix_size, size, position;
+} part_input_t;
+
+/* an IDR access unit, where the stream can be cut into independently decodable parts */
+typedef struct {
+	/* offset of the non-VCL NALUs ahead of the first slice, or of the slice if there are none */
+	size_t start;
+	/* whether the NALUs ahead of the slice include an SPS */
+	bool sps;
+	/* the non-VCL NALUs of the latest access unit with an SPS up to this one, size zero if none */
+	size_t prefix_start, prefix_size;
+} idr_unit_t;
 
-static void video_decode(const char *filename)
+/* the files of the command line, claimed one at a time by the threads decoding them */
+typedef struct {
+	const char **file;
+	size_t count, next;
+	bool failed;
+	pthread_mutex_t lock;
+} file_pool_t;
+
+
+static bool video_decode(const char *filename, AVIOContext *input, int threads)
 {
 	AVInputFormat *format;
 	AVFormatContext *format_context;
@@ -18,33 +61,39 @@ static void video_decode(const char *filename)
 	int video_stream, frame_finished;
 	
 	if (!(format = av_find_input_format("h264")))
-		return;
+		return false;
 	if (!(format_context = avformat_alloc_context()))
-		return;
-	if (avformat_open_input(&format_context, filename, format, NULL) < 0)
-		return;
+		return false;
+	/* a part of the stream is read from memory */
+	format_context->pb = input;
+	/* a single dash reads the stream from stdin */
+	if (avformat_open_input(&format_context, strcmp(filename, "-") ? filename : "pipe:0", format, NULL) < 0)
+		return false;
 	if (avformat_find_stream_info(format_context, NULL) < 0)
-		return;
+		return false;
 	if ((video_stream = av_find_best_stream(format_context, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0)) < 0)
-		return;
+		return false;
 	if (!(codec_context = format_context->streams[video_stream]->codec))
-		return;
+		return false;
 	if (!(codec = avcodec_find_decoder(codec_context->codec_id)))
-		return;
+		return false;
 	
+	/* the decoder's own threads, the processing may still restrict them */
+	codec_context->thread_count = threads;
 	process_init(codec_context, filename);
 	
 	if (avcodec_open2(codec_context, codec, NULL) < 0)
-		return;
+		return false;
 	if (!(frame = avcodec_alloc_frame()))
-		return;
+		return false;
 	
 	while (av_read_frame(format_context, &packet) >= 0) {
 		if (packet.stream_index == video_stream) {
 			AVPacket working_packet = packet;
+			process_packet(codec_context, &packet);
 			do {
 				int length = avcodec_decode_video2(codec_context, frame, &frame_finished, &working_packet);
-				if (length < 0) return;
+				if (length < 0) return false;
 				working_packet.size -= length;
 				working_packet.data += length;
 			} while (working_packet.size);
@@ -55,19 +104,279 @@ static void video_decode(const char *filename)
 	packet.data = NULL;
 	do {
 		if (avcodec_decode_video2(codec_context, frame, &frame_finished, &packet) < 0)
-			return;
+			return false;
 	} while (frame_finished);
 	
 	av_free(frame);
 	avcodec_close(codec_context);
 	process_finish(codec_context);
 	avformat_close_input(&format_context);
+	return true;
+}
+
+static int part_read(void *opaque, uint8_t *buf, int buf_size)
+{
+	part_input_t *part = opaque;
+	const size_t total = part->prefix_size + part->size;
+	size_t count = 0;
+	
+	while (count < (size_t)buf_size && part->position < total) {
+		const uint8_t *from;
+		size_t available;
+		if (part->position < part->prefix_size) {
+			from = &part->prefix[part->position];
+			available = part->prefix_size - part->position;
+		} else {
+			from = &part->data[part->position - part->prefix_size];
+			available = total - part->position;
+		}
+		if (available > (size_t)buf_size - count)
+			available = (size_t)buf_size - count;
+		memcpy(&buf[count], from, available);
+		count += available;
+		part->position += available;
+	}
+	
+	return (int)count;
+}
+
+/* Finds the positions where the stream can be cut into independently decodable GOPs: the access
+ * units of IDR pictures, starting with the non-VCL NALUs ahead of the first slice. Along with
+ * them goes the latest access unit with an SPS, whose parameter sets a part needs if it has none.
+ * The units are stored in a growing array, returns false if it cannot be allocated. */
+static bool find_idr_units(const uint8_t *data, size_t size, idr_unit_t **unit, size_t *count)
+{
+	size_t capacity = 0, lead = SIZE_MAX, prefix_start = 0, prefix_size = 0;
+	bool lead_sps = false;
+	
+	*unit = NULL;
+	*count = 0;
+	for (size_t i = 2; i + 2 < size;) {
+		const uint8_t *one = memchr(&data[i], 0x01, size - 2 - i);
+		if (!one) break;
+		const size_t found = (size_t)(one - data);
+		i = found + 1;
+		if (data[found - 1] != 0 || data[found - 2] != 0)
+			continue;
+		
+		const size_t nalu = found - 2;
+		const unsigned type = data[found + 1] & 0x1F;
+		if (type >= 6 && type <= 9) {
+			/* SEI, SPS, PPS and access unit delimiter lead the slices of their picture */
+			if (lead == SIZE_MAX) lead = nalu;
+			lead_sps |= (type == 7);
+		} else {
+			/* the first slice of a picture has first_mb_in_slice coded as a single one bit */
+			const bool first_slice = (type == 1 || type == 5) && (data[found + 2] & 0x80);
+			if (first_slice && lead_sps) {
+				/* parameter sets may be repeated ahead of any picture, the latest ones count */
+				prefix_start = lead;
+				prefix_size = nalu - lead;
+			}
+			if (first_slice && type == 5) {
+				if (*count == capacity) {
+					capacity = capacity ? 2 * capacity : 256;
+					idr_unit_t *grown = realloc(*unit, capacity * sizeof(idr_unit_t));
+					if (!grown) {
+						free(*unit);
+						*unit = NULL;
+						return false;
+					}
+					*unit = grown;
+				}
+				(*unit)[*count].start = (lead == SIZE_MAX) ? nalu : lead;
+				(*unit)[*count].sps = lead_sps;
+				(*unit)[*count].prefix_start = prefix_start;
+				(*unit)[*count].prefix_size = prefix_size;
+				(*count)++;
+			}
+			lead = SIZE_MAX;
+			lead_sps = false;
+		}
+	}
+	
+	return true;
+}
+
+static bool wait_part(void)
+{
+	int status;
+	if (wait(&status) < 0) return false;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Splits the file at IDR pictures and processes the parts in parallel, each in its own process
+ * with its own decoder, then merges the outputs. Returns false if the file is rather processed
+ * as a whole, because it cannot or need not be split. */
+static bool video_decode_parallel(const char *filename)
+{
+	if (THREADS < 2 || !process_mergeable() || strcmp(filename, "-") == 0)
+		return false;
+	
+	const int fd = open(filename, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+		close(fd);
+		return false;
+	}
+	const size_t size = (size_t)info.st_size;
+	const uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return false;
+	
+	idr_unit_t *unit;
+	size_t units;
+	if (!find_idr_units(data, size, &unit, &units)) {
+		munmap((void *)(uintptr_t)data, size);
+		return false;
+	}
+	
+	/* group the GOPs into parts of roughly equal size, the first part starts with the file */
+	const size_t part_size = size / (THREADS * PARTS_PER_THREAD) + 1;
+	process_part_t *part = malloc((units + 1) * sizeof(process_part_t));
+	size_t *part_unit = malloc((units + 1) * sizeof(size_t));
+	size_t parts = 0;
+	for (size_t i = 0; part && part_unit && i < units; i++) {
+		if (i > 0 && unit[i].start - part[parts - 1].start < part_size)
+			continue;
+		if (i == 0 && unit[i].start > 0) {
+			/* whatever comes before the first IDR stays with it */
+			part[parts].start = 0;
+		} else {
+			part[parts].start = unit[i].start;
+		}
+		part_unit[parts] = i;
+		parts++;
+	}
+	
+	/* later parts without their own parameter sets need some from earlier in the stream */
+	bool success = (parts > 1);
+	for (size_t i = 1; i < parts; i++)
+		success &= (unit[part_unit[i]].sps || unit[part_unit[i]].prefix_size > 0);
+	if (success) {
+		size_t running = 0;
+		
+		fflush(NULL);
+		for (size_t i = 0; i < parts; i++) {
+			const size_t end = (i + 1 < parts) ? part[i + 1].start : size;
+			const idr_unit_t *first = &unit[part_unit[i]];
+			part[i].skip = (i > 0 && !first->sps) ? first->prefix_size : 0;
+			part[i].file = malloc(strlen(filename) + sizeof("_.h264") + 3 * sizeof(size_t));
+			if (!part[i].file) {
+				success = false;
+				parts = i;
+				break;
+			}
+			sprintf(part[i].file, "%s_%zu.h264", filename, i);
+			
+			if (running == THREADS) {
+				success &= wait_part();
+				running--;
+			}
+			const pid_t pid = fork();
+			if (pid == 0) {
+				part_input_t input = {
+					.prefix = &data[first->prefix_start], .prefix_size = part[i].skip,
+					.data = &data[part[i].start], .size = end - part[i].start,
+					.position = 0
+				};
+				uint8_t *buffer = av_malloc(PART_IO_SIZE);
+				AVIOContext *context = buffer ? avio_alloc_context(buffer, PART_IO_SIZE, 0, &input, part_read, NULL, NULL) : NULL;
+				exit((context && video_decode(part[i].file, context, 1)) ? 0 : 1);
+			}
+			if (pid < 0) {
+				success = false;
+				free(part[i].file);
+				parts = i;
+				break;
+			}
+			running++;
+		}
+		while (running--)
+			success &= wait_part();
+		
+		if (!success) {
+			fprintf(stderr, "parallel processing of %s failed\n", filename);
+			exit(1);
+		}
+		process_merge(filename, part, parts);
+		for (size_t i = 0; i < parts; i++)
+			free(part[i].file);
+	}
+	
+	free(part_unit);
+	free(part);
+	free(unit);
+	munmap((void *)(uintptr_t)data, size);
+	return success;
+}
+
+static int lock_manager(void **mutex, enum AVLockOp op)
+{
+	switch (op) {
+		case AV_LOCK_CREATE:
+			*mutex = malloc(sizeof(pthread_mutex_t));
+			return !*mutex || pthread_mutex_init(*mutex, NULL);
+		case AV_LOCK_OBTAIN:
+			return pthread_mutex_lock(*mutex);
+		case AV_LOCK_RELEASE:
+			return pthread_mutex_unlock(*mutex);
+		case AV_LOCK_DESTROY:
+			pthread_mutex_destroy(*mutex);
+			free(*mutex);
+			return 0;
+	}
+	return 1;
+}
+
+static void *decode_files(void *context)
+{
+	file_pool_t *pool = context;
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		const size_t i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= pool->count) return NULL;
+		if (!video_decode(pool->file[i], NULL, 1)) {
+			pthread_mutex_lock(&pool->lock);
+			pool->failed = true;
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+}
+
+/* decodes the files concurrently, each with its own decoder and processing context;
+ * false leaves them to be processed one after another, failed tells if any file failed */
+static bool video_decode_concurrent(const char **file, size_t count, bool *failed)
+{
+	if (THREADS < 2 || count < 2)
+		return false;
+	/* FFmpeg serializes opening and closing of decoders with these locks */
+	if (av_lockmgr_register(lock_manager) < 0)
+		return false;
+	
+	file_pool_t pool = { .file = file, .count = count, .next = 0 };
+	pthread_t thread[THREADS - 1];
+	size_t threads;
+	pthread_mutex_init(&pool.lock, NULL);
+	for (threads = 0; threads < THREADS - 1 && threads < count - 1; threads++)
+		if (pthread_create(&thread[threads], NULL, decode_files, &pool) != 0)
+			break;
+	/* the main thread is one of the pool */
+	decode_files(&pool);
+	while (threads--)
+		pthread_join(thread[threads], NULL);
+	pthread_mutex_destroy(&pool.lock);
+	*failed = pool.failed;
+	return true;
 }
 
 
 int main(int argc, const char **argv)
 {
 	const char *filename;
+	bool failed = false;
 	int i;
 	
 	avcodec_register_all();
@@ -77,8 +386,12 @@ int main(int argc, const char **argv)
 		return 1;
 	filename = argv[1];
 	
+	if (video_decode_concurrent(argv + 1, (size_t)(argc - 1), &failed))
+		return failed;
+	/* a file processed as a whole has the cores to itself */
 	for (i = 1; i < argc; i++)
-		video_decode(argv[i]);
+		if (!video_decode_parallel(argv[i]))
+			failed |= !video_decode(argv[i], NULL, THREADS);
 	
-	return 0;
+	return failed;
 }